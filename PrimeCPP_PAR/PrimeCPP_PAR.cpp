@@ -12,144 +12,4400 @@
 #include <vector>
 #include <thread>
 #include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <unordered_map>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <random>
+#include <future>
+#include <numeric>
+#include <tuple>
+#include <iterator>
+#include <cctype>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
 
 const uint64_t DEFAULT_UPPER_LIMIT = 10'000'000LLU;
+const size_t   DEFAULT_SEGMENT_BYTES = 32 * 1024;              // One L1 data cache's worth of sieve per segment
 
-// prime_sieve
+// resultsDictionary
+//
+// Historical data for validating our results - the number of primes to be found under some limit, such as 168
+// primes under 1000.  This data isn't used in the sieve processing at all, only to sanity check the results.
+
+const std::map<const uint64_t, const int> resultsDictionary =
+{
+      {             10LLU, 4         },
+      {            100LLU, 25        },
+      {          1'000LLU, 168       },
+      {         10'000LLU, 1229      },
+      {        100'000LLU, 9592      },
+      {      1'000'000LLU, 78498     },
+      {     10'000'000LLU, 664579    },
+      {    100'000'000LLU, 5761455   },
+      {  1'000'000'000LLU, 50847534  },
+      { 10'000'000'000LLU, 455052511 },
+};
+
+// expectedCount / validateCount
+//
+// The reference count of primes below a limit comes from the historical data, or failing that from a pi(x)
+// checkpoint table if one was loaded (see pi_checkpoints).  Limits we have no reference for fail validation.
+
+bool checkpointCount(uint64_t limit, size_t &count);
+
+bool expectedCount(uint64_t limit, size_t &count)
+{
+    auto result = resultsDictionary.find(limit);
+    if (resultsDictionary.end() != result)
+    {
+        count = (size_t) result->second;
+        return true;
+    }
+    return checkpointCount(limit, count);
+}
+
+bool hasExpectedCount(uint64_t limit)
+{
+    size_t count;
+    return expectedCount(limit, count);
+}
+
+bool validateCount(uint64_t limit, size_t count)
+{
+    size_t expected;
+    return expectedCount(limit, expected) && expected == count;
+}
+
+// popcount64
+//
+// Number of set bits in a 64-bit word, using the hardware instruction where the compiler offers one.
+
+inline size_t popcount64(uint64_t word)
+{
+#ifdef _MSC_VER
+    return (size_t) __popcnt64(word);
+#else
+    return (size_t) __builtin_popcountll(word);
+#endif
+}
+
+// ctz64
+//
+// Index of the lowest set bit of a nonzero 64-bit word.
+
+inline unsigned ctz64(uint64_t word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (unsigned) index;
+#else
+    return (unsigned) __builtin_ctzll(word);
+#endif
+}
+
+// prefetchWrite
+//
+// Hints that the cache line holding 'address' is about to be written.
+
+inline void prefetchWrite(const void *address)
+{
+#ifdef _MSC_VER
+    _mm_prefetch((const char *) address, _MM_HINT_T0);
+#else
+    __builtin_prefetch(address, 1);
+#endif
+}
+
+// selectInWord
+//
+// Index of the r-th (0-based) set bit of a 64-bit word that has more than r bits set.
+
+inline unsigned selectInWord(uint64_t word, unsigned r)
+{
+    for (; r; r--)
+        word &= word - 1;
+    return ctz64(word);
+}
+
+// extractPrimes
+//
+// Turns an odd-only bitmap, whose first bit stands for low + 1, into the values it marks.  Each word is decoded
+// with the tzcnt/blsr idiom four entries at a time against its popcount, so there is no data-dependent branch per
+// prime; the price is that up to EXTRACT_SLACK entries past the last one may be scribbled on, so 'out' must have
+// that much room to spare.  T may be narrower than 64 bits if the caller passes values relative to some base.
+// Returns the number of values written.
+
+const size_t EXTRACT_SLACK = 3;
+
+template <typename T>
+size_t extractPrimes(const uint64_t *words, size_t wordCount, uint64_t low, T *out)
+{
+    T *start = out;
+    for (size_t w = 0; w < wordCount; w++)
+    {
+        uint64_t bits  = words[w];
+        size_t   found = popcount64(bits);
+        T        base  = (T) (low + 128 * w + 1);
+
+        for (size_t i = 0; i < found; i += 4)
+        {
+            out[i]     = base + (T) (2 * ctz64(bits | (1ULL << 63)));  // The top bit keeps ctz defined once the
+            bits &= bits - 1;                                          // word runs dry in the slack entries
+            out[i + 1] = base + (T) (2 * ctz64(bits | (1ULL << 63)));
+            bits &= bits - 1;
+            out[i + 2] = base + (T) (2 * ctz64(bits | (1ULL << 63)));
+            bits &= bits - 1;
+            out[i + 3] = base + (T) (2 * ctz64(bits | (1ULL << 63)));
+            bits &= bits - 1;
+        }
+        out += found;
+    }
+    return (size_t) (out - start);
+}
+
+// Phase timers
 //
-// Represents the data comprising the sieve (an array of N bits, where N is the upper limit prime being tested)
-// as well as the code needed to eliminate non-primes from its array, which you perform by calling runSieve.
+// Build with -DPRIME_INSTRUMENT to have the sieves time their phases (init, search, cross-off, count, output)
+// with the CPU's timestamp counter, which needs no perf privileges.  PHASE_TIMER(phase) times the rest of the
+// enclosing scope, and time spent under a nested timer is charged to the inner phase only.  Each thread adds up
+// its own ticks and merges them into the shared totals when it exits, so the hot path never touches shared
+// memory; PHASE_REPORT() prints the breakdown.  Without PRIME_INSTRUMENT both macros compile to nothing.
+
+#ifdef PRIME_INSTRUMENT
+
+#if !defined(_MSC_VER) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+enum class sieve_phase
+{
+    init,
+    search,
+    crossOff,
+    count,
+    output,
+};
+
+const size_t PHASE_TOTAL = 5;
+const char  *phaseNames[PHASE_TOTAL] = { "init", "search", "cross-off", "count", "output" };
+
+inline uint64_t readTsc()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t) duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct phase_totals
+{
+    mutex    lock;
+    uint64_t ticks[PHASE_TOTAL] = {};
+    uint64_t calls[PHASE_TOTAL] = {};
+    uint64_t startTsc           = readTsc();                    // For converting ticks to seconds at report time
+    steady_clock::time_point startTime = steady_clock::now();
+};
+
+phase_totals &phaseTotals()
+{
+    static phase_totals totals;
+    return totals;
+}
+
+class scoped_phase_timer;
+
+struct phase_accumulator
+{
+    uint64_t ticks[PHASE_TOTAL] = {};
+    uint64_t calls[PHASE_TOTAL] = {};
+    scoped_phase_timer *current = nullptr;                      // Innermost timer running on this thread
+
+    ~phase_accumulator()
+    {
+        merge();
+    }
 
-class prime_sieve
+    void merge()
+    {
+        auto &totals = phaseTotals();
+        lock_guard<mutex> guard(totals.lock);
+        for (size_t i = 0; i < PHASE_TOTAL; i++)
+        {
+            totals.ticks[i] += ticks[i];
+            totals.calls[i] += calls[i];
+            ticks[i] = calls[i] = 0;
+        }
+    }
+};
+
+thread_local phase_accumulator phaseAccumulator;
+
+class scoped_phase_timer
 {
   private:
 
-      vector<bool> Bits;                                        // Sieve data, where 1==prime, 0==not
+      size_t   phase;
+      uint64_t start;
+      uint64_t nested = 0;                                      // Ticks already charged to inner timers
+      scoped_phase_timer *outer;
 
-   public:
+  public:
 
-      prime_sieve(uint64_t n) : Bits(n, true)                  // Initialize all to true (potential primes)
+      explicit scoped_phase_timer(sieve_phase which) : phase((size_t) which), outer(phaseAccumulator.current)
       {
+          phaseAccumulator.current = this;
+          start = readTsc();
       }
 
-      ~prime_sieve()
+      scoped_phase_timer(const scoped_phase_timer &) = delete;
+      scoped_phase_timer &operator=(const scoped_phase_timer &) = delete;
+
+      ~scoped_phase_timer()
       {
+          uint64_t elapsed = readTsc() - start;
+          auto &accumulator = phaseAccumulator;
+          accumulator.ticks[phase] += elapsed - nested;
+          accumulator.calls[phase]++;
+          if (outer)
+              outer->nested += elapsed;
+          accumulator.current = outer;
       }
+};
 
-      // runSieve
+// reportPhases
+//
+// Prints the time each phase took, summed over every thread that has exited plus the calling one.  Ticks are
+// converted to seconds by timing the counter against steady_clock over the life of the program.
+
+void reportPhases()
+{
+    phaseAccumulator.merge();
+
+    auto &totals = phaseTotals();
+    lock_guard<mutex> guard(totals.lock);
+
+    double seconds = duration_cast<duration<double>>(steady_clock::now() - totals.startTime).count();
+    double ticksPerSecond = seconds > 0 ? (readTsc() - totals.startTsc) / seconds : 1;
+    uint64_t allTicks = 0;
+    for (size_t i = 0; i < PHASE_TOTAL; i++)
+        allTicks += totals.ticks[i];
+
+    printf("Phase breakdown (summed over threads):\n");
+    for (size_t i = 0; i < PHASE_TOTAL; i++)
+        printf("  %-10s %10.6f s  %5.1f%%  %12llu calls\n",
+               phaseNames[i],
+               totals.ticks[i] / ticksPerSecond,
+               allTicks ? 100.0 * totals.ticks[i] / allTicks : 0.0,
+               (unsigned long long) totals.calls[i]);
+}
+
+#define PHASE_TIMER(phase) scoped_phase_timer phaseTimer(sieve_phase::phase)
+#define PHASE_REPORT()     reportPhases()
+
+#else
+
+#define PHASE_TIMER(phase)
+#define PHASE_REPORT()
+
+#endif
+
+// cpu_topology
+//
+// Logical CPUs grouped by the physical core they share, read from each CPU's topology/thread_siblings_list under
+// /sys/devices/system/cpu and limited to the CPUs this process may run on.  Where that can't be read, every
+// logical CPU counts as a core of its own.
+
+struct cpu_topology
+{
+    vector<vector<int>> cores;                                  // The logical CPUs of each physical core
+
+    size_t logicalCount() const
+    {
+        size_t count = 0;
+        for (auto &core : cores)
+            count += core.size();
+        return count;
+    }
+
+    // placement
+    //
+    // The CPUs to put workers on: the first sibling of every core when 'smt' is off, or every logical CPU when
+    // it's on, ordered so that each core gets its first worker before any core gets a second.
+
+    vector<int> placement(bool smt) const
+    {
+        vector<int> cpus;
+        for (size_t rank = 0; rank == 0 || smt; rank++)
+        {
+            size_t added = 0;
+            for (auto &core : cores)
+                if (rank < core.size())
+                {
+                    cpus.push_back(core[rank]);
+                    added++;
+                }
+            if (!added)
+                break;
+        }
+        return cpus;
+    }
+};
+
+// parseCpuList
+//
+// Reads a kernel CPU list such as "0-3,8,10-11".
+
+vector<int> parseCpuList(const string &list)
+{
+    vector<int> cpus;
+    stringstream stream(list);
+    string range;
+    while (getline(stream, range, ','))
+    {
+        int first = 0, last = 0;
+        int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields < 1)
+            continue;
+        for (int cpu = first; cpu <= (fields == 2 ? last : first); cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+cpu_topology detectCpuTopology()
+{
+    cpu_topology topology;
+    unsigned logical = max(1u, thread::hardware_concurrency());
+
+#ifdef __linux__
+    cpu_set_t allowed;
+    bool bMasked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        ifstream siblingsFile("/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/thread_siblings_list");
+        string list;
+        if (!(siblingsFile >> list))
+        {
+            if (cpu >= (int) logical)
+                break;
+            continue;
+        }
+        if (bMasked && !CPU_ISSET(cpu, &allowed))
+            continue;
+
+        vector<int> siblings;
+        for (int sibling : parseCpuList(list))
+            if (!bMasked || CPU_ISSET(sibling, &allowed))
+                siblings.push_back(sibling);
+        if (!siblings.empty() && siblings.front() == cpu)       // Each core is recorded by its first sibling
+            topology.cores.push_back(siblings);
+    }
+#endif
+
+    if (topology.cores.empty())
+        for (unsigned cpu = 0; cpu < logical; cpu++)
+            topology.cores.push_back({ (int) cpu });
+    return topology;
+}
+
+// pinCurrentThread
+//
+// Restricts the calling thread to one logical CPU.  Returns false where that isn't supported or allowed.
+
+bool pinCurrentThread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), 1ULL << cpu) != 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+// currentThreadCpus
+//
+// The logical CPUs the calling thread may run on, in placement order (each core's first sibling before any
+// second one).  Where the affinity mask can't be read, every CPU in the placement counts.
+
+vector<int> currentThreadCpus()
+{
+    static const vector<int> placement = detectCpuTopology().placement(true);
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed) == 0)
+    {
+        vector<int> cpus;
+        for (int cpu : placement)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        return cpus;
+    }
+#endif
+    return placement;
+}
+
+// sliceCpuOffset
+//
+// Where the calling thread's slices start in its list of CPUs.  Each thread gets its own offset, spaced 'threads'
+// apart from the last thread's, the first time it asks and keeps it, so its fill and its crossing agree.
+
+unsigned int sliceCpuOffset(unsigned int threads)
+{
+    static atomic<unsigned int> next{0};
+    thread_local unsigned int offset = next.fetch_add(threads);
+    return offset;
+}
+
+// forEachSlice
+//
+// Splits [0, n) into 'threads' contiguous slices with boundaries on multiples of 64, so that no two slices share
+// a word of flags, and runs onSlice(first, last) for each on a thread of its own before waiting for them all.
+// A sieve fills its buffer and then crosses it off with the same split, and slice t's thread is pinned to the
+// same CPU every time, so each slice is crossed off by the core (and on the NUMA node) that first touched its
+// pages.  The CPUs come from the caller's own affinity mask, and each calling thread starts at its own offset
+// into them so that sieves running side by side don't all land on the same few.  A caller already pinned to one
+// CPU (as --smt does) keeps its slices there, and a single slice just runs on the caller's thread.
+
+template <typename Callback>
+void forEachSlice(uint64_t n, unsigned int threads, Callback &&onSlice)
+{
+    uint64_t units = (n + 63) / 64;
+    threads = (unsigned int) max<uint64_t>(1, min<uint64_t>(threads, units));
+    if (threads == 1)
+    {
+        onSlice(0, n);
+        return;
+    }
+
+    unsigned int offset = sliceCpuOffset(threads);
+    vector<int>  cpus   = currentThreadCpus();
+
+    vector<thread> workers;
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        uint64_t first = min(n, units * t / threads * 64);
+        uint64_t last  = min(n, units * (t + 1) / threads * 64);
+        int cpu = cpus.size() > 1 ? cpus[(offset + t) % cpus.size()] : -1;
+        workers.push_back(thread([first, last, cpu, &onSlice]
+        {
+            if (cpu >= 0)
+                pinCurrentThread(cpu);
+            onSlice(first, last);
+        }));
+    }
+    for (auto &worker : workers)
+        worker.join();
+}
+
+// adviseHugePages
+//
+// Asks the kernel to back the whole pages within [address, address + bytes) with transparent huge pages, which
+// saves TLB misses on the scattered writes of a big sieve.  It has to come before the buffer is first touched.
+// A hint only: where there's no madvise, or the kernel says no, nothing changes.
+
+void adviseHugePages(void *address, size_t bytes)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    const uintptr_t PAGE_BYTES = 4096;
+    uintptr_t first = ((uintptr_t) address + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+    uintptr_t last  = ((uintptr_t) address + bytes) & ~(PAGE_BYTES - 1);
+    if (last > first)
+        madvise((void *) first, last - first, MADV_HUGEPAGE);
+#else
+    (void) address;
+    (void) bytes;
+#endif
+}
+
+// Storage policies
+//
+// Where basic_prime_sieve keeps one flag per candidate, where set means "still possibly prime".  bool_storage is
+// the original vector<bool>, bit_storage packs the flags into 64-bit words by hand (so counting is a popcount per
+// word), and byte_storage spends a whole byte per flag to make every access a plain load or store.  reset(n,
+// threads, hugePages) fills the flags with forEachSlice; the bit and byte buffers are allocated without being
+// touched so that the filling threads place the pages (huge ones if asked), while vector<bool> fills itself on
+// one thread and in ordinary pages whatever we ask.
+
+struct bool_storage
+{
+    vector<bool> flags;
+
+    void   reset(size_t n, unsigned int = 1, bool = false) { flags.assign(n, true); }
+    bool   test(size_t i) const     { return flags[i]; }
+    void   clear(size_t i)          { flags[i] = false; }
+    size_t count() const            { return (size_t) std::count(flags.begin(), flags.end(), true); }
+    static const char *name()       { return "bool"; }
+    static uint64_t bytesFor(uint64_t n) { return (n + 63) / 64 * 8; }
+};
+
+struct bit_storage
+{
+    unique_ptr<uint64_t[]> words;
+    size_t wordCount = 0;
+
+    void reset(size_t n, unsigned int threads = 1, bool hugePages = false)
+    {
+        wordCount = (n + 63) / 64;
+        words.reset(new uint64_t[wordCount]);
+        if (hugePages)
+            adviseHugePages(words.get(), wordCount * sizeof(uint64_t));
+        forEachSlice(n, threads, [this](uint64_t first, uint64_t last)
+        {
+            fill(words.get() + first / 64, words.get() + (last + 63) / 64, ~0ULL);
+        });
+        if (n % 64)
+            words[wordCount - 1] = (1ULL << (n % 64)) - 1;
+    }
+    bool   test(size_t i) const     { return words[i / 64] >> (i % 64) & 1; }
+    void   clear(size_t i)          { words[i / 64] &= ~(1ULL << (i % 64)); }
+    size_t count() const
+    {
+        size_t total = 0;
+        for (size_t w = 0; w < wordCount; w++)
+            total += popcount64(words[w]);
+        return total;
+    }
+    static const char *name()       { return "bit"; }
+    static uint64_t bytesFor(uint64_t n) { return (n + 63) / 64 * 8; }
+};
+
+struct byte_storage
+{
+    unique_ptr<uint8_t[]> bytes;
+    size_t byteCount = 0;
+
+    void reset(size_t n, unsigned int threads = 1, bool hugePages = false)
+    {
+        byteCount = n;
+        bytes.reset(new uint8_t[byteCount]);
+        if (hugePages)
+            adviseHugePages(bytes.get(), byteCount);
+        forEachSlice(n, threads, [this](uint64_t first, uint64_t last)
+        {
+            memset(bytes.get() + first, 1, (size_t) (last - first));
+        });
+    }
+    bool   test(size_t i) const     { return bytes[i]; }
+    void   clear(size_t i)          { bytes[i] = 0; }
+    size_t count() const            { return (size_t) std::count(bytes.get(), bytes.get() + byteCount, 1); }
+    static const char *name()       { return "byte"; }
+    static uint64_t bytesFor(uint64_t n) { return n; }
+};
+
+// forEachSetFlag
+//
+// Calls onIndex(i) for every flag still set among the first n, in increasing order.  bit_storage hands its words
+// to extractPrimes a block at a time; told the bitmap starts one below twice its first index, that kernel writes
+// out 2i for each set bit i.
+// The other storages are tested flag by flag.
+
+template <typename Storage, typename Callback>
+void forEachSetFlag(const Storage &flags, uint64_t n, Callback &&onIndex)
+{
+    for (uint64_t i = 0; i < n; i++)
+        if (flags.test((size_t) i))
+            onIndex(i);
+}
+
+template <typename Callback>
+void forEachSetFlag(const bit_storage &flags, uint64_t, Callback &&onIndex)
+{
+    const size_t BLOCK = 64;                                   // Words extracted at a time
+    uint64_t doubled[BLOCK * 64 + EXTRACT_SLACK];
+
+    for (size_t w = 0; w < flags.wordCount; w += BLOCK)
+    {
+        size_t found = extractPrimes(flags.words.get() + w, min(BLOCK, flags.wordCount - w), 128 * w - 1, doubled);
+        for (size_t k = 0; k < found; k++)
+            onIndex(doubled[k] / 2);
+    }
+}
+
+// wheel
+//
+// Wheel policy: only numbers coprime to the modulus W are stored, so a wheel of 2 keeps the odd numbers, 6 drops
+// multiples of 3 as well, and 30 and 210 go on through 5 and 7.  Candidate i stands for (i / R) * W + residues[i % R]
+// where R is the number of residues coprime to W; the tables are built at compile time.
+
+template <typename T>
+constexpr T gcdConst(T a, T b)
+{
+    while (b)
+    {
+        T t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+constexpr unsigned totientConst(unsigned w)
+{
+    unsigned count = 0;
+    for (unsigned r = 1; r < w; r++)
+        count += (gcdConst(r, w) == 1);
+    return count;
+}
+
+template <unsigned W>
+struct wheel
+{
+    static constexpr unsigned modulus = W;
+    static constexpr unsigned residueCount = totientConst(W);
+
+    struct tables
+    {
+        unsigned residues[residueCount];                        // The residues coprime to W, ascending
+        int      position[W];                                   // Index of each residue in residues, or -1
+    };
+
+    static constexpr tables build()
+    {
+        tables t {};
+        unsigned k = 0;
+        for (unsigned r = 0; r < W; r++)
+        {
+            if (gcdConst(r, W) == 1)
+            {
+                t.residues[k] = r;
+                t.position[r] = (int) k++;
+            }
+            else
+                t.position[r] = -1;
+        }
+        return t;
+    }
+
+    static constexpr tables table = build();
+};
+
+// Before C++17 a static constexpr member that is ODR-used (table is indexed through a reference) still needs a
+// definition at namespace scope, or the link fails under -std=c++14
+
+template <unsigned W> constexpr typename wheel<W>::tables wheel<W>::table;
+
+// basic_prime_sieve
+//
+// Represents the data comprising the sieve (one flag per candidate below the limit N, the candidates being the
+// numbers the wheel doesn't rule out) as well as the code needed to eliminate non-primes from it, which you
+// perform by calling runSieve.  Storage and Wheel are the policies above and Index is the integer type used to
+// address candidates, so every combination compiles to its own inner loop with nothing dispatched at runtime.
+// 32-bit indexing covers up to 2^31 candidates.
+
+template <typename Storage, typename Wheel, typename Index>
+class basic_prime_sieve
+{
+  private:
+
+      static constexpr unsigned W = Wheel::modulus;
+      static constexpr unsigned R = Wheel::residueCount;
+
+      uint64_t limit;
+      Index candidates;                                         // Number of candidates below the limit
+      Storage Bits;                                             // Sieve data, where 1==prime, 0==not
+
+      static Index indexOf(uint64_t n)                         // n must be coprime to W
+      {
+          return (Index) ((n / W) * R + Wheel::table.position[n % W]);
+      }
+
+      static uint64_t valueOf(Index i)
+      {
+          return (uint64_t) (i / R) * W + Wheel::table.residues[i % R];
+      }
+
+      // wheelPrimes
       //
-      // Scan the array for the next factor (>2) that hasn't yet been eliminated from the array, and then
-      // walk through the array crossing off every multiple of that factor.
+      // The primes dividing W, which the wheel has no candidates for and so are accounted for separately
 
-      void runSieve()
+      static size_t wheelPrimesBelow(uint64_t n)
       {
-          uint64_t factor = 3;
-          uint64_t q = (int) sqrt(Bits.size());
+          size_t count = 0;
+          for (unsigned p : { 2u, 3u, 5u, 7u })
+              count += (W % p == 0 && p < n);
+          return count;
+      }
 
-          while (factor <= q)
-          {
-              for (uint64_t num = factor; num < Bits.size(); num += 2)
-              {
-                  if (Bits[num])
-                  {
-                      factor = num;
-                      break;
-                  }
-              }
-              for (uint64_t num = factor * factor; num < Bits.size(); num += factor * 2)
-                  Bits[num] = false;
+   public:
 
-              factor += 2;            
-          }
+      static uint64_t maxLimit()                                // Largest limit the Index type can address
+      {
+          return (sizeof(Index) >= sizeof(uint64_t)) ? UINT64_MAX : ((1ULL << 31) / R) * W;
       }
 
-      // countPrimes
+      static uint64_t candidatesBelow(uint64_t n)
+      {
+          uint64_t count = (n / W) * R;
+          for (unsigned r : Wheel::table.residues)
+              count += (r < n % W);
+          return count;
+      }
+
+      static uint64_t memoryBytes(uint64_t n)                   // What the sieve for a limit of n will allocate
+      {
+          return Storage::bytesFor(candidatesBelow(n));
+      }
+
+      basic_prime_sieve(uint64_t n, unsigned int threads = 1, bool hugePages = false) : limit(n)
+      {
+          PHASE_TIMER(init);
+          candidates = (Index) candidatesBelow(n);
+          Bits.reset(candidates, threads, hugePages);           // Initialize all to true (potential primes)
+          if (candidates)
+              Bits.clear(0);                                    // Candidate 0 is the number 1
+      }
+
+      ~basic_prime_sieve()
+      {
+      }
+
+      // runSieve
+      //
+      // Scan the array for the next factor that hasn't yet been eliminated from the array, and then walk through
+      // the array crossing off every multiple of that factor.
+
+      void runSieve()
+      {
+          PHASE_TIMER(search);
+          for (Index i = 1; i < candidates; i++)
+          {
+              while (i < candidates && !Bits.test(i))
+                  i++;
+              uint64_t factor = valueOf(i);
+              if (i >= candidates || factor * factor >= limit)
+                  break;
+              crossOff(factor);
+          }
+      }
+
+      // runSieve (cooperative)
+      //
+      // The same sieve with the candidates split across threads just as the constructor split them to fill, each
+      // thread crossing off the multiples of every factor within its own slice.  No slice can wait on another to
+      // find the factors, so they come from a small sieve up to sqrt(limit) first.
+
+      void runSieve(unsigned int threads)
+      {
+          if (threads <= 1)
+              return runSieve();
+
+          vector<uint64_t> factors;
+          {
+              PHASE_TIMER(search);
+              basic_prime_sieve small((uint64_t) sqrt((double) limit) + 2);
+              small.runSieve();
+              for (Index i = 1; i < small.candidates; i++)
+                  if (small.Bits.test(i) && valueOf(i) * valueOf(i) < limit)
+                      factors.push_back(valueOf(i));
+          }
+
+          forEachSlice(candidates, threads, [this, &factors](uint64_t first, uint64_t last)
+          {
+              for (uint64_t factor : factors)
+                  crossOffSlice(factor, first, last);
+          });
+      }
+
+      // nextFactor
+      //
+      // The first candidate at or after 'factor' that hasn't been crossed off (or 'factor' itself if none is left)
+
+      uint64_t nextFactor(uint64_t factor) const
+      {
+          Index i = (Index) ((factor / W) * R);
+          while (i < candidates && valueOf(i) < factor)
+              i++;
+          for (; i < candidates; i++)
+              if (Bits.test(i))
+                  return valueOf(i);
+          return factor;
+      }
+
+      // crossOff
+      //
+      // Crosses off the multiples of 'factor' (a candidate) from its square up.  Only multiples factor * m with m a
+      // candidate need crossing, and as m steps through one turn of the wheel the index of factor * m moves by the
+      // same offsets each turn, so those R offsets are worked out once and the loop just adds factor * R per turn.
+
+      void crossOff(uint64_t factor)
+      {
+          PHASE_TIMER(crossOff);
+          Index first = indexOf(factor);
+          Index offsets[R];
+          for (unsigned j = 0; j < R; j++)
+              offsets[j] = indexOf(factor * valueOf(first + j));
+
+          Index turn = (Index) (factor * R);
+          for (Index base = 0; ; base += turn)
+          {
+              for (unsigned j = 0; j < R; j++)
+              {
+                  Index i = offsets[j] + base;
+                  if (i >= candidates)
+                      return;
+                  Bits.clear(i);
+              }
+          }
+      }
+
+      // runSieves
+      //
+      // Runs several independent sieves of the same limit in lockstep.  They all find the same factors, so each
+      // factor's multiples are crossed off in every sieve at once, one write to each in turn; those writes don't
+      // depend on each other, so while one sieve's write waits on a cache miss the others' can be in flight.
+
+      static void runSieves(const vector<basic_prime_sieve *> &sieves)
+      {
+          if (sieves.empty())
+              return;
+
+          PHASE_TIMER(search);
+          auto &lead = *sieves.front();
+          for (Index i = 1; i < lead.candidates; i++)
+          {
+              while (i < lead.candidates && !lead.Bits.test(i))
+                  i++;
+              uint64_t factor = valueOf(i);
+              if (i >= lead.candidates || factor * factor >= lead.limit)
+                  break;
+              crossOffTogether(sieves, factor);
+          }
+      }
+
+      static void crossOffTogether(const vector<basic_prime_sieve *> &sieves, uint64_t factor)
+      {
+          PHASE_TIMER(crossOff);
+          Index first = indexOf(factor);
+          Index offsets[R];
+          for (unsigned j = 0; j < R; j++)
+              offsets[j] = indexOf(factor * valueOf(first + j));
+
+          Index candidates = sieves.front()->candidates;
+          Index turn = (Index) (factor * R);
+          for (Index base = 0; ; base += turn)
+          {
+              for (unsigned j = 0; j < R; j++)
+              {
+                  Index i = offsets[j] + base;
+                  if (i >= candidates)
+                      return;
+                  for (auto *sieve : sieves)
+                      sieve->Bits.clear(i);
+              }
+          }
+      }
+
+      // crossOffSlice
+      //
+      // crossOff restricted to the candidates in [first, last): each of the R residue streams starts at its first
+      // index inside the slice rather than from the factor's square.
+
+      void crossOffSlice(uint64_t factor, uint64_t first, uint64_t last)
+      {
+          PHASE_TIMER(crossOff);
+          uint64_t start = indexOf(factor);
+          uint64_t turn  = factor * R;
+          for (unsigned j = 0; j < R; j++)
+          {
+              uint64_t i = indexOf(factor * valueOf((Index) (start + j)));
+              if (i < first)
+                  i += (first - i + turn - 1) / turn * turn;
+              for (; i < last; i += turn)
+                  Bits.clear((Index) i);
+          }
+      }
+
+      // countPrimes
       //
       // Can be called after runSieve to determine how many primes were found in total
 
-      size_t countPrimes() const
+      size_t countPrimes() const
+      {
+          PHASE_TIMER(count);
+          return Bits.count() + wheelPrimesBelow(limit);
+      }
+
+      // isPrime 
+      // 
+      // Can be called after runSieve to determine whether a given number (below the limit) is prime. 
+
+      bool isPrime(uint64_t n) const
+      {
+          for (unsigned p : { 2u, 3u, 5u, 7u })
+              if (W % p == 0 && n % p == 0)
+                  return n == p;
+          return n > 1 && Bits.test(indexOf(n));
+      }
+
+      // validateResults
+      //
+      // Checks to see if the number of primes found matches what we should expect.  This data isn't used in the
+      // sieve processing at all, only to sanity check that the results are right when done.
+
+      bool validateResults() const
+      {
+          return validateCount(limit, countPrimes());
+      }
+
+      // printResults
+      //
+      // Displays stats about what was found as well as (optionally) the primes themselves
+
+      void printResults(bool showResults, double duration, size_t passes, size_t threads) const
+      {
+          PHASE_TIMER(output);
+          size_t count = 0;
+          for (unsigned p : { 2u, 3u, 5u, 7u })
+          {
+              if (W % p == 0 && p < limit)
+              {
+                  if (showResults)
+                      cout << p << ", ";
+                  count++;
+              }
+          }
+
+          forEachSetFlag(Bits, candidates, [&](uint64_t i)
+          {
+              if (showResults)
+                  cout << valueOf((Index) i) << ", ";
+              count++;
+          });
+
+          if (showResults)
+              cout << "\n";
+          
+          cout << "Passes: " << passes << ", "
+               << "Threads: " << threads << ", "
+               << "Time: " << duration << ", " 
+               << "Average: " << duration/passes << ", "
+               << "Limit: " << limit << ", "
+               << "Counts: " << count << "/" << countPrimes() << ", "
+               << "Valid : " << (validateResults() ? "Pass" : "FAIL!") 
+               << "\n";
+      }
+};
+
+// prime_sieve
+//
+// The classic layout: vector<bool> over the odd numbers, addressed with 64-bit indices
+
+using prime_sieve = basic_prime_sieve<bool_storage, wheel<2>, uint64_t>;
+
+// sieve_layout
+//
+// Storage, wheel and index width of the basic engine, as picked on the command line, and withLayout, which calls
+// back with a null pointer of the matching basic_prime_sieve type so the caller's generic lambda can use it.
+
+struct sieve_layout
+{
+    string   storage   = "bool";
+    unsigned wheel     = 2;
+    unsigned indexBits = 64;
+};
+
+template <typename Storage, typename Wheel, typename Callback>
+bool withLayoutIndex(const sieve_layout &layout, Callback &&callback)
+{
+    if (layout.indexBits == 32)
+        callback((basic_prime_sieve<Storage, Wheel, uint32_t> *) nullptr);
+    else if (layout.indexBits == 64)
+        callback((basic_prime_sieve<Storage, Wheel, uint64_t> *) nullptr);
+    else
+        return false;
+    return true;
+}
+
+template <typename Storage, typename Callback>
+bool withLayoutWheel(const sieve_layout &layout, Callback &&callback)
+{
+    switch (layout.wheel)
+    {
+        case 2:   return withLayoutIndex<Storage, wheel<2>>(layout, callback);
+        case 6:   return withLayoutIndex<Storage, wheel<6>>(layout, callback);
+        case 30:  return withLayoutIndex<Storage, wheel<30>>(layout, callback);
+        case 210: return withLayoutIndex<Storage, wheel<210>>(layout, callback);
+        default:  return false;
+    }
+}
+
+template <typename Callback>
+bool withLayout(const sieve_layout &layout, Callback &&callback)
+{
+    if (layout.storage == "bool")
+        return withLayoutWheel<bool_storage>(layout, callback);
+    if (layout.storage == "bit")
+        return withLayoutWheel<bit_storage>(layout, callback);
+    if (layout.storage == "byte")
+        return withLayoutWheel<byte_storage>(layout, callback);
+    return false;
+}
+
+// cache_topology
+//
+// Data cache sizes of the CPU we're running on, read from /sys/devices/system/cpu/cpu0/cache where that exists.
+// Anything we can't find stays at zero and the geometry falls back to the compiled-in defaults.
+
+struct cache_topology
+{
+    size_t l1d = 0;
+    size_t l2  = 0;
+    size_t l3  = 0;
+};
+
+cache_topology detectCacheTopology()
+{
+    cache_topology caches;
+    for (int index = 0; index < 8; index++)
+    {
+        string path = "/sys/devices/system/cpu/cpu0/cache/index" + to_string(index) + "/";
+        ifstream levelFile(path + "level"), typeFile(path + "type"), sizeFile(path + "size");
+        int level = 0;
+        string type, size;
+        if (!(levelFile >> level) || !(typeFile >> type) || !(sizeFile >> size) || type == "Instruction")
+            continue;
+
+        size_t bytes = (size_t) strtoull(size.c_str(), nullptr, 10);
+        if (size.back() == 'K')
+            bytes <<= 10;
+        else if (size.back() == 'M')
+            bytes <<= 20;
+
+        if (level == 1)
+            caches.l1d = bytes;
+        else if (level == 2)
+            caches.l2 = bytes;
+        else if (level == 3)
+            caches.l3 = bytes;
+    }
+    return caches;
+}
+
+// sieve_geometry
+//
+// How the segmented engines carve up their work: the segment size, and the bounds of the small-prime tier
+// (primes that strike every word of a segment more than once) and the medium-prime tier (primes that strike at
+// least once per segment).  Primes above the medium bound are the large tier.
+
+struct sieve_geometry
+{
+    size_t   segmentBytes     = DEFAULT_SEGMENT_BYTES;
+    uint64_t smallPrimeLimit  = 64;
+    uint64_t mediumPrimeLimit = DEFAULT_SEGMENT_BYTES * 8;
+    bool     prefetchMedium   = false;                          // Whether segments outgrow L1, see crossOffMedium
+    sieve_layout layout;                                        // How the basic engine stores its candidates
+    unsigned int sieveThreads     = 1;                          // Threads filling and crossing each basic sieve
+    unsigned int interleave       = 1;                          // Basic sieves each pass runs in lockstep
+    bool     hugePages        = false;                          // Back basic bit/byte sieves with huge pages
+    string   source           = "default";                      // Where the segment size came from, for reports
+};
+
+// chooseGeometry
+//
+// Sizes segments to the L1 data cache, which keeps every crossing write a cache hit, unless overridden.  A zero
+// override means "pick it for me"; the medium tier bound follows the segment size unless it's set explicitly,
+// and never sits below the small bound, since the medium tier starts where the small one ends.
+
+sieve_geometry chooseGeometry(const cache_topology &caches, size_t segmentBytes, uint64_t smallLimit, uint64_t mediumLimit)
+{
+    sieve_geometry geometry;
+    if (segmentBytes)
+    {
+        geometry.segmentBytes = segmentBytes;
+        geometry.source = "override";
+    }
+    else if (caches.l1d)
+    {
+        geometry.segmentBytes = caches.l1d;
+        geometry.source = "detected";
+    }
+    geometry.segmentBytes     = max<size_t>(8, geometry.segmentBytes & ~size_t(7));
+    geometry.smallPrimeLimit  = smallLimit ? smallLimit : geometry.smallPrimeLimit;
+    geometry.mediumPrimeLimit = max(geometry.smallPrimeLimit, mediumLimit ? mediumLimit : (uint64_t) geometry.segmentBytes * 8);
+    geometry.prefetchMedium   = geometry.segmentBytes > (caches.l1d ? caches.l1d : DEFAULT_SEGMENT_BYTES);
+    return geometry;
+}
+
+// segmented_sieve
+//
+// Sieves [0, limit) one cache-sized segment at a time instead of holding the whole range in memory.  Only odd
+// numbers are stored, one bit each, so bit i of the segment starting at (even) 'low' stands for low + 2*i + 1.
+// The base primes up to sqrt(limit) are found once with an ordinary prime_sieve and reused for every segment.
+
+class segmented_sieve
+{
+  private:
+
+      uint64_t limit;
+      size_t segmentBytes;
+      vector<uint32_t> basePrimes;                              // Odd primes up to sqrt(limit)
+      size_t smallEnd;                                          // basePrimes[0, smallEnd) is the small tier
+      size_t mediumEnd;                                         // basePrimes[smallEnd, mediumEnd) is the medium tier
+      bool prefetch;                                            // Prefetch in the medium tier (segments beyond L1)
+
+   public:
+
+      segmented_sieve(uint64_t n, const sieve_geometry &geometry = sieve_geometry())
+        : limit(n), segmentBytes(max<size_t>(8, geometry.segmentBytes & ~size_t(7))), prefetch(geometry.prefetchMedium)
+      {
+          uint64_t root = min<uint64_t>((uint64_t) sqrt((double) n), UINT32_MAX);    // isqrt of any uint64_t fits
+          while (root * root > n)
+              root--;
+          while (root + 1 <= n / (root + 1))
+              root++;
+
+          prime_sieve baseSieve(root + 1);
+          baseSieve.runSieve();
+          for (uint64_t num = 3; num <= root; num += 2)
+              if (baseSieve.isPrime(num))
+                  basePrimes.push_back((uint32_t) num);
+
+          smallEnd  = lower_bound(basePrimes.begin(), basePrimes.end(), geometry.smallPrimeLimit) - basePrimes.begin();
+          mediumEnd = lower_bound(basePrimes.begin(), basePrimes.end(), max(geometry.smallPrimeLimit, geometry.mediumPrimeLimit)) - basePrimes.begin();
+      }
+
+      uint64_t size() const                 { return limit; }
+      size_t   segmentWords() const         { return segmentBytes / sizeof(uint64_t); }
+      uint64_t segmentSpan() const          { return (uint64_t) segmentBytes * 16; }   // Numbers covered per segment
+      const vector<uint32_t> &primes() const { return basePrimes; }
+      size_t   smallTierEnd() const         { return smallEnd; }
+      size_t   mediumTierEnd() const        { return mediumEnd; }
+
+      // sieveSegment
+      //
+      // Fills 'words' with the odd-number bitmap of [low, high), where low is even and high <= limit.  Bits past
+      // the end of the range are cleared so that callers can popcount whole words.  Returns the number of bits used.
+
+      size_t sieveSegment(uint64_t low, uint64_t high, vector<uint64_t> &words) const
+      {
+          size_t bits = (size_t) ((high - low) / 2);
+          {
+              PHASE_TIMER(init);
+              words.assign(segmentWords(), ~0ULL);
+          }
+          PHASE_TIMER(crossOff);
+          crossOff(low, high, words, 0, basePrimes.size());
+
+          if (low == 0)
+              words[0] &= ~1ULL;                                  // 1 is not prime
+
+          if (bits % 64)
+              words[bits / 64] &= (1ULL << (bits % 64)) - 1;
+          for (size_t w = (bits + 63) / 64; w < words.size(); w++)
+              words[w] = 0;
+          return bits;
+      }
+
+      // firstMultiple
+      //
+      // Bit index in the segment starting at 'low' of the first odd multiple of p worth crossing off, which is
+      // p squared or the first odd multiple inside the segment, whichever comes later.
+
+      static uint64_t firstMultiple(uint64_t p, uint64_t low)
+      {
+          if (p * p >= low)
+              return (p * p - low) / 2;
+
+          uint64_t offset = (p - low % p) % p;                   // Worked as an offset so low near 2^64 can't wrap
+          if (!(offset & 1))
+              offset += p;
+          return offset / 2;
+      }
+
+      // crossOffMedium
+      //
+      // Medium primes strike a handful of scattered words per segment, so a one-prime-at-a-time loop spends most
+      // of its time waiting on the previous write.  Here MEDIUM_GROUP primes advance together, giving the core
+      // independent write streams to overlap.  When the segment is bigger than L1 each stream also prefetches the
+      // line it will need a few strides on; inside L1 that's pure overhead.
+
+      static const size_t MEDIUM_GROUP    = 4;
+      static const size_t PREFETCH_STRIDES = 4;
+
+      template <bool Prefetch>
+      void crossOffMedium(uint64_t low, uint64_t high, vector<uint64_t> &words, size_t first, size_t last) const
+      {
+          size_t bits = (size_t) ((high - low) / 2);
+          uint64_t *data = words.data();
+          size_t k = first;
+
+          for (; k + MEDIUM_GROUP <= last; k += MEDIUM_GROUP)
+          {
+              uint64_t step[MEDIUM_GROUP], next[MEDIUM_GROUP];
+              for (size_t g = 0; g < MEDIUM_GROUP; g++)
+              {
+                  step[g] = basePrimes[k + g];
+                  next[g] = (step[g] * step[g] >= high) ? bits : firstMultiple(step[g], low);
+              }
+              if (next[0] >= bits && step[0] * step[0] >= high)
+                  return;                                         // Every later prime is past its square too
+
+              uint64_t stop = bits;                               // Keep prefetches inside the segment
+              for (size_t g = 0; Prefetch && g < MEDIUM_GROUP; g++)
+                  stop = min<uint64_t>(stop, bits > PREFETCH_STRIDES * step[g] ? bits - PREFETCH_STRIDES * step[g] : 0);
+
+              auto allBeforeStop = [&next, stop]
+              {
+                  for (size_t g = 0; g < MEDIUM_GROUP; g++)
+                      if (next[g] >= stop)
+                          return false;
+                  return true;
+              };
+
+              while (allBeforeStop())
+              {
+                  for (size_t g = 0; g < MEDIUM_GROUP; g++)
+                  {
+                      if (Prefetch)
+                          prefetchWrite(data + (next[g] + PREFETCH_STRIDES * step[g]) / 64);
+                      data[next[g] / 64] &= ~(1ULL << (next[g] % 64));
+                      next[g] += step[g];
+                  }
+              }
+              for (size_t g = 0; g < MEDIUM_GROUP; g++)
+                  for (uint64_t i = next[g]; i < bits; i += step[g])
+                      data[i / 64] &= ~(1ULL << (i % 64));
+          }
+          crossOffSimple(low, high, words, k, last);
+      }
+
+      // crossOffSimple
+      //
+      // One prime at a time, which is all the small primes need (their strides stay within a few words) and all
+      // the large ones can use (they strike a segment at most once or twice).
+
+      void crossOffSimple(uint64_t low, uint64_t high, vector<uint64_t> &words, size_t first, size_t last) const
+      {
+          size_t bits = (size_t) ((high - low) / 2);
+          for (size_t k = first; k < last; k++)
+          {
+              uint64_t p = basePrimes[k];
+              if (p * p >= high)
+                  break;
+
+              for (uint64_t i = firstMultiple(p, low); i < bits; i += p)
+                  words[i / 64] &= ~(1ULL << (i % 64));
+          }
+      }
+
+      // crossOff
+      //
+      // Crosses the odd multiples of basePrimes[first, last) out of the bitmap of [low, high), each from its square
+      // or the first multiple in the segment, whichever comes later, using the kernel that suits each tier.
+
+      void crossOff(uint64_t low, uint64_t high, vector<uint64_t> &words, size_t first, size_t last) const
+      {
+          size_t smallLast  = min(last, smallEnd);
+          size_t mediumLast = min(last, mediumEnd);
+
+          crossOffSimple(low, high, words, first, smallLast);
+          if (prefetch)
+              crossOffMedium<true>(low, high, words, max(first, smallEnd), mediumLast);
+          else
+              crossOffMedium<false>(low, high, words, max(first, smallEnd), mediumLast);
+          crossOffSimple(low, high, words, max(first, mediumEnd), last);
+      }
+
+      // countBits
+      //
+      // Counts the set bits among the first 'bits' bits of a segment bitmap.
+
+      static size_t countBits(const vector<uint64_t> &words, size_t bits)
+      {
+          size_t count = 0;
+          for (size_t w = 0; w < bits / 64; w++)
+              count += popcount64(words[w]);
+          if (bits % 64)
+              count += popcount64(words[bits / 64] & ((1ULL << (bits % 64)) - 1));
+          return count;
+      }
+
+      // forEachPrime
+      //
+      // Calls onPrime(n) for every prime recorded in a segment bitmap that starts at 'low', in increasing order.
+
+      template <typename Callback>
+      static void forEachPrime(const vector<uint64_t> &words, uint64_t low, Callback &&onPrime)
+      {
+          const size_t BLOCK = 64;                               // Words extracted at a time, 8K numbers
+          uint64_t primes[BLOCK * 64 + EXTRACT_SLACK];
+
+          for (size_t w = 0; w < words.size(); w += BLOCK)
+          {
+              size_t found = extractPrimes(words.data() + w, min(BLOCK, words.size() - w), low + 128 * w, primes);
+              for (size_t i = 0; i < found; i++)
+                  onPrime(primes[i]);
+          }
+      }
+
+      // sweep
+      //
+      // Sieves every segment in order, handing each one to onSegment(low, high, words, bits).
+
+      template <typename Callback>
+      void sweep(Callback &&onSegment) const
+      {
+          vector<uint64_t> words;
+          for (uint64_t low = 0; low < limit; low += segmentSpan())
+          {
+              uint64_t high = min(limit, low + segmentSpan());
+              size_t bits = sieveSegment(low, high, words);
+              onSegment(low, high, words, bits);
+          }
+      }
+
+      // countPrimes
+      //
+      // Number of primes below the limit, 2 included
+
+      size_t countPrimes() const
+      {
+          PHASE_TIMER(count);
+          size_t count = (limit > 2);
+          sweep([&count](uint64_t, uint64_t, const vector<uint64_t> &words, size_t bits)
+          {
+              count += countBits(words, bits);
+          });
+          return count;
+      }
+
+      // countPrimes (cooperative)
+      //
+      // The same count with the segments dealt out round-robin to 'threads' threads, so that one sieve can use
+      // several cores.  Interleaving keeps the work even, since later segments have fewer primes to cross off.
+
+      size_t countPrimes(unsigned int threads) const
+      {
+          if (threads <= 1)
+              return countPrimes();
+
+          uint64_t segments = (limit + segmentSpan() - 1) / segmentSpan();
+          vector<size_t> counts(threads, 0);
+          vector<thread> workers;
+
+          for (unsigned int t = 0; t < threads; t++)
+          {
+              workers.push_back(thread([this, t, threads, segments, &counts]
+              {
+                  PHASE_TIMER(count);
+                  vector<uint64_t> words;
+                  size_t count = 0;
+                  for (uint64_t seg = t; seg < segments; seg += threads)
+                  {
+                      uint64_t low = seg * segmentSpan();
+                      count += countBits(words, sieveSegment(low, min(limit, low + segmentSpan()), words));
+                  }
+                  counts[t] = count;
+              }));
+          }
+          for (auto &th : workers)
+              th.join();
+
+          size_t count = (limit > 2);
+          for (size_t c : counts)
+              count += c;
+          return count;
+      }
+};
+
+// batchSieve
+//
+// Sieves once up to the largest of the requested limits and reports the prime count below each of them as the
+// sweep passes its boundary, so a whole table of limits costs about the same as its largest entry alone.
+
+struct batch_result
+{
+    uint64_t limit;
+    size_t   count;
+    bool     valid;
+};
+
+vector<batch_result> batchSieve(vector<uint64_t> limits, const sieve_geometry &geometry = sieve_geometry())
+{
+    vector<batch_result> results;
+    if (limits.empty())
+        return results;
+
+    sort(limits.begin(), limits.end());
+    limits.erase(unique(limits.begin(), limits.end()), limits.end());
+
+    segmented_sieve sieve(limits.back(), geometry);
+    size_t count = 0;
+    auto next = limits.begin();
+
+    while (next != limits.end() && *next <= 2)                  // Below 3 there is nothing for the sweep to see
+    {
+        results.push_back({ *next, 0, validateCount(*next, 0) });
+        ++next;
+    }
+    count = 1;                                                  // 2 is prime, and every remaining limit is above it
+
+    sieve.sweep([&](uint64_t low, uint64_t high, const vector<uint64_t> &words, size_t bits)
+    {
+        for (; next != limits.end() && *next <= high; ++next)
+        {
+            size_t total = count + segmented_sieve::countBits(words, (size_t) ((*next - low) / 2));
+            results.push_back({ *next, total, validateCount(*next, total) });
+        }
+        count += segmented_sieve::countBits(words, bits);
+    });
+
+    return results;
+}
+
+// prime_generator
+//
+// Pull-based stream of the primes below a limit.  A background worker sieves the next segment while the
+// consumer walks the current one, so at most two segments are ever held and the consumer only waits at a
+// segment boundary if it outruns the sieve.  Use next() directly or iterate with a range-based for.
+
+class prime_generator
+{
+  private:
+
+      struct segment
+      {
+          uint64_t low  = 0;
+          uint64_t high = 0;
+          vector<uint64_t> words;
+          vector<uint64_t> primes;                              // Extracted on the worker, with EXTRACT_SLACK spare
+          size_t count = 0;
+      };
+
+      segmented_sieve sieve;
+      segment current;                                          // Segment being handed out to the consumer
+      segment ahead;                                            // Segment the worker fills next
+      size_t index = 0;                                         // Next entry of current.primes to hand out
+      bool started = false;
+
+      mutex lock;
+      condition_variable changed;
+      bool aheadReady = false;
+      bool stopping = false;
+      uint64_t nextLow = 0;
+      thread worker;
+
+      void workerLoop()
+      {
+          unique_lock<mutex> guard(lock);
+          while (true)
+          {
+              changed.wait(guard, [this] { return !aheadReady || stopping; });
+              if (stopping)
+                  return;
+
+              uint64_t low = min(nextLow, sieve.size());
+              nextLow = low + sieve.segmentSpan();
+              guard.unlock();
+
+              ahead.low  = low;
+              ahead.high = min(sieve.size(), low + sieve.segmentSpan());
+              ahead.count = 0;
+              if (ahead.low < ahead.high)                       // Past the limit, an empty segment marks the end
+              {
+                  size_t bits = sieve.sieveSegment(ahead.low, ahead.high, ahead.words);
+                  ahead.primes.resize(segmented_sieve::countBits(ahead.words, bits) + EXTRACT_SLACK);
+                  ahead.count = extractPrimes(ahead.words.data(), ahead.words.size(), ahead.low, ahead.primes.data());
+              }
+
+              guard.lock();
+              aheadReady = true;
+              changed.notify_all();
+          }
+      }
+
+      // advance
+      //
+      // Swaps in the segment the worker has prepared and sets it off on the one after.  False at the end.
+
+      bool advance()
+      {
+          unique_lock<mutex> guard(lock);
+          changed.wait(guard, [this] { return aheadReady; });
+          swap(current, ahead);
+          aheadReady = false;
+          changed.notify_all();
+
+          index = 0;
+          return current.low < current.high;
+      }
+
+   public:
+
+      prime_generator(uint64_t limit, const sieve_geometry &geometry = sieve_geometry())
+        : sieve(limit, geometry)
+      {
+          worker = thread([this] { workerLoop(); });
+      }
+
+      prime_generator(const prime_generator &) = delete;
+      prime_generator &operator=(const prime_generator &) = delete;
+
+      ~prime_generator()
+      {
+          {
+              lock_guard<mutex> guard(lock);
+              stopping = true;
+          }
+          changed.notify_all();
+          worker.join();
+      }
+
+      // next
+      //
+      // Stores the next prime in 'prime' and returns true, or returns false once the limit has been reached.
+
+      bool next(uint64_t &prime)
+      {
+          if (!started)
+          {
+              started = true;
+              bool more = advance();
+              if (sieve.size() > 2)
+              {
+                  prime = 2;
+                  return true;
+              }
+              if (!more)
+                  return false;
+          }
+
+          while (index >= current.count)
+          {
+              if (!advance())
+                  return false;
+          }
+          prime = current.primes[index++];
+          return true;
+      }
+
+      class iterator
+      {
+        private:
+            prime_generator *source;
+            uint64_t value = 0;
+
+        public:
+            explicit iterator(prime_generator *gen) : source(gen) { ++*this; }
+
+            uint64_t operator*() const                 { return value; }
+            bool operator!=(const iterator &rhs) const { return source != rhs.source; }
+            iterator &operator++()
+            {
+                if (source && !source->next(value))
+                    source = nullptr;
+                return *this;
+            }
+      };
+
+      iterator begin() { return iterator(this); }
+      iterator end()   { return iterator(nullptr); }
+};
+
+// elias_fano_primes
+//
+// Compact, immutable store of the primes below a limit.  Each prime is split into 'lowBits' low bits, kept
+// verbatim in a packed array, and a high part, kept in unary as a bitmap where prime k sets bit (high + k).
+// That costs about 2 + log2(limit / count) bits per prime, well under the odd-only bitmap at large limits.
+// Every 256th one and zero in the high bitmap is sampled, so the k-th prime and the successor of any value
+// are found with a short scan of a few words.
+
+class elias_fano_primes
+{
+  private:
+
+      static const size_t SAMPLE = 256;
+
+      uint64_t limit;
+      size_t count = 0;
+      unsigned lowBits = 0;
+      vector<uint64_t> lows;
+      vector<uint64_t> highs;
+      vector<size_t> oneSamples;                                // Position in highs of every SAMPLE'th one
+      vector<size_t> zeroSamples;                               // Position in highs of every SAMPLE'th zero
+
+      void append(uint64_t prime)
+      {
+          if (lowBits)
+          {
+              uint64_t low = prime & ((1ULL << lowBits) - 1);
+              size_t bit = count * lowBits;
+              lows[bit / 64] |= low << (bit % 64);
+              if (bit % 64 + lowBits > 64)
+                  lows[bit / 64 + 1] |= low >> (64 - bit % 64);
+          }
+          size_t pos = (size_t) (prime >> lowBits) + count;
+          highs[pos / 64] |= 1ULL << (pos % 64);
+          count++;
+      }
+
+      uint64_t lowPart(size_t k) const
+      {
+          if (!lowBits)
+              return 0;
+          size_t bit = k * lowBits;
+          uint64_t value = lows[bit / 64] >> (bit % 64);
+          if (bit % 64 + lowBits > 64)
+              value |= lows[bit / 64 + 1] << (64 - bit % 64);
+          return value & ((1ULL << lowBits) - 1);
+      }
+
+      // select
+      //
+      // Position in highs of the r-th one (or zero, when 'zeros' is set), starting from the nearest sample
+
+      size_t select(size_t r, bool zeros) const
+      {
+          const vector<size_t> &samples = zeros ? zeroSamples : oneSamples;
+          size_t pos  = samples[r / SAMPLE];
+          size_t left = r % SAMPLE;
+          size_t w    = pos / 64;
+          uint64_t word = (zeros ? ~highs[w] : highs[w]) & (~0ULL << (pos % 64));
+
+          while (popcount64(word) <= left)
+          {
+              left -= popcount64(word);
+              w++;
+              word = zeros ? ~highs[w] : highs[w];
+          }
+          return w * 64 + selectInWord(word, (unsigned) left);
+      }
+
+   public:
+
+      explicit elias_fano_primes(uint64_t n, const sieve_geometry &geometry = sieve_geometry())
+        : limit(n)
+      {
+          // Size for an upper bound on pi(limit) and trim afterwards, which saves sieving the range twice
+
+          double x = (double) max<uint64_t>(limit, 17);
+          size_t bound = (size_t) (1.25506 * x / log(x)) + 2;
+          uint64_t ratio = limit / bound;
+          while (ratio > 1)
+          {
+              lowBits++;
+              ratio >>= 1;
+          }
+
+          lows.assign((bound * lowBits + 63) / 64 + 1, 0);
+          highs.assign((bound + (size_t) (limit >> lowBits) + 1) / 64 + 2, 0);
+
+          segmented_sieve sieve(limit, geometry);
+          if (limit > 2)
+              append(2);
+          sieve.sweep([this](uint64_t low, uint64_t, const vector<uint64_t> &words, size_t)
+          {
+              segmented_sieve::forEachPrime(words, low, [this](uint64_t prime) { append(prime); });
+          });
+
+          size_t highBits = count + (size_t) (limit >> lowBits) + 1;
+          lows.resize((count * lowBits + 63) / 64 + 1);
+          highs.resize(highBits / 64 + 2);
+          lows.shrink_to_fit();
+          highs.shrink_to_fit();
+
+          // Sample every SAMPLE'th one and zero a word at a time: popcount says whether a word holds the next
+          // sample at all, and selectInWord finds it if it does
+
+          size_t ones = 0, zeros = 0;
+          for (size_t w = 0; w < highs.size(); w++)
+          {
+              uint64_t word = highs[w];
+              size_t wordOnes = popcount64(word), wordZeros = 64 - wordOnes;
+              for (size_t next = (ones + SAMPLE - 1) / SAMPLE * SAMPLE; next < ones + wordOnes; next += SAMPLE)
+                  oneSamples.push_back(w * 64 + selectInWord(word, (unsigned) (next - ones)));
+              for (size_t next = (zeros + SAMPLE - 1) / SAMPLE * SAMPLE; next < zeros + wordZeros; next += SAMPLE)
+                  zeroSamples.push_back(w * 64 + selectInWord(~word, (unsigned) (next - zeros)));
+              ones  += wordOnes;
+              zeros += wordZeros;
+          }
+      }
+
+      size_t size() const { return count; }
+
+      // operator[]
+      //
+      // The k-th prime, counting 2 as prime 0.  k must be below size().
+
+      uint64_t operator[](size_t k) const
+      {
+          return ((uint64_t) (select(k, false) - k) << lowBits) | lowPart(k);
+      }
+
+      // rank
+      //
+      // Number of stored primes below x, which is pi(x - 1) as long as x is within the limit.
+
+      size_t rank(uint64_t x) const
+      {
+          if (x >= limit)
+              return count;
+
+          uint64_t high = x >> lowBits;
+          size_t k = (high == 0) ? 0 : select((size_t) high - 1, true) - (size_t) (high - 1);
+          while (k < count && (*this)[k] < x)
+              k++;
+          return k;
+      }
+
+      // successor
+      //
+      // Smallest stored prime >= x, if there is one.
+
+      bool successor(uint64_t x, uint64_t &prime) const
+      {
+          size_t k = rank(x);
+          if (k >= count)
+              return false;
+          prime = (*this)[k];
+          return true;
+      }
+
+      size_t memoryBytes() const
+      {
+          return (lows.size() + highs.size()) * sizeof(uint64_t) + (oneSamples.size() + zeroSamples.size()) * sizeof(size_t);
+      }
+};
+
+// spsc_ring
+//
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.  The two indices live on
+// separate cache lines and only ever increase; each side publishes its index with release semantics and reads
+// the other's with acquire, which is all the ordering a single producer/consumer pair needs.
+
+template <typename T>
+class spsc_ring
+{
+  private:
+
+      vector<T> slots;
+      size_t mask;
+      alignas(64) atomic<size_t> head { 0 };                    // Next slot to pop, written only by the consumer
+      alignas(64) atomic<size_t> tail { 0 };                    // Next slot to push, written only by the producer
+
+   public:
+
+      explicit spsc_ring(size_t capacity)
+      {
+          size_t size = 1;
+          while (size < capacity)
+              size <<= 1;
+          slots.resize(size);
+          mask = size - 1;
+      }
+
+      bool tryPush(const T &value)
+      {
+          size_t t = tail.load(memory_order_relaxed);
+          if (t - head.load(memory_order_acquire) == slots.size())
+              return false;
+          slots[t & mask] = value;
+          tail.store(t + 1, memory_order_release);
+          return true;
+      }
+
+      bool tryPop(T &value)
+      {
+          size_t h = head.load(memory_order_relaxed);
+          if (h == tail.load(memory_order_acquire))
+              return false;
+          value = slots[h & mask];
+          head.store(h + 1, memory_order_release);
+          return true;
+      }
+
+      void push(const T &value)
+      {
+          while (!tryPush(value))
+              this_thread::yield();
+      }
+
+      T pop()
+      {
+          T value;
+          while (!tryPop(value))
+              this_thread::yield();
+          return value;
+      }
+};
+
+// sieve_pipeline
+//
+// Runs a segmented sieve as a pipeline.  Each producer thread sieves every Nth segment into buffers taken from
+// its own free list and hands them on through its own ring; the first stage drains those rings round-robin, so
+// every stage sees the segments in order without any ring needing more than one producer.  Each stage runs on
+// its own thread and passes the buffer down the chain, and the last one returns it to the owner's free list.
+// Producers never wait on output unless every one of their buffers is still in flight, and vice versa.
+
+struct segment_buffer
+{
+    uint64_t low   = 0;
+    uint64_t high  = 0;
+    size_t   bits  = 0;
+    size_t   owner = 0;                                         // Producer whose free list this buffer returns to
+    vector<uint64_t> words;
+};
+
+class sieve_pipeline
+{
+  private:
+
+      using ring = spsc_ring<segment_buffer *>;
+
+      const segmented_sieve &sieve;
+      size_t producers;
+      size_t buffersPerProducer;
+      vector<function<void(const segment_buffer &)>> stages;
+
+   public:
+
+      sieve_pipeline(const segmented_sieve &source, size_t producerThreads, size_t buffersEach = 4)
+        : sieve(source), producers(max<size_t>(1, producerThreads)), buffersPerProducer(max<size_t>(1, buffersEach))
+      {
+      }
+
+      // addStage
+      //
+      // Appends a consumer stage.  Stages are called with the segments in increasing order, one thread per stage.
+
+      void addStage(function<void(const segment_buffer &)> stage)
+      {
+          stages.push_back(move(stage));
+      }
+
+      void run()
+      {
+          if (stages.empty())
+              return;
+
+          size_t segments = (size_t) ((sieve.size() + sieve.segmentSpan() - 1) / sieve.segmentSpan());
+          size_t inFlight = producers * buffersPerProducer;
+
+          vector<segment_buffer> buffers(inFlight);
+          vector<unique_ptr<ring>> freeRings, fullRings, links;
+          for (size_t p = 0; p < producers; p++)
+          {
+              freeRings.push_back(make_unique<ring>(buffersPerProducer));
+              fullRings.push_back(make_unique<ring>(buffersPerProducer));
+              for (size_t b = 0; b < buffersPerProducer; b++)
+              {
+                  auto &buffer = buffers[p * buffersPerProducer + b];
+                  buffer.owner = p;
+                  freeRings[p]->push(&buffer);
+              }
+          }
+          for (size_t s = 1; s < stages.size(); s++)
+              links.push_back(make_unique<ring>(inFlight));
+
+          vector<thread> threads;
+
+          for (size_t p = 0; p < producers; p++)
+          {
+              threads.push_back(thread([&, p]
+              {
+                  for (size_t seg = p; seg < segments; seg += producers)
+                  {
+                      segment_buffer *buffer = freeRings[p]->pop();
+                      buffer->low  = seg * sieve.segmentSpan();
+                      buffer->high = min(sieve.size(), buffer->low + sieve.segmentSpan());
+                      buffer->bits = sieve.sieveSegment(buffer->low, buffer->high, buffer->words);
+                      fullRings[p]->push(buffer);
+                  }
+              }));
+          }
+
+          for (size_t s = 0; s < stages.size(); s++)
+          {
+              threads.push_back(thread([&, s]
+              {
+                  for (size_t seg = 0; seg < segments; seg++)
+                  {
+                      segment_buffer *buffer = (s == 0) ? fullRings[seg % producers]->pop() : links[s - 1]->pop();
+                      stages[s](*buffer);
+                      if (s + 1 < stages.size())
+                          links[s]->push(buffer);
+                      else
+                          freeRings[buffer->owner]->push(buffer);
+                  }
+              }));
+          }
+
+          for (auto &th : threads)
+              th.join();
+      }
+};
+
+// prime_query_engine
+//
+// Answers isPrime(n) for scattered n without sieving everything below them.  The range is cut into fixed
+// segments; the first query to land in a segment sieves just that segment, and the result is kept in an LRU
+// cache capped at a given number of bytes.  The base primes grow on demand to cover sqrt of the largest n seen,
+// which for n up to 2^64 means at most the primes below 2^32.
+
+class prime_query_engine
+{
+  private:
+
+      using segment_list = list<uint64_t>;
+
+      struct cached_segment
+      {
+          vector<uint64_t> words;
+          segment_list::iterator age;                           // Position in 'recent', front is most recent
+      };
+
+      sieve_geometry geometry;
+      unique_ptr<segmented_sieve> sieve;                        // Base primes; its limit is the coverable range
+      size_t maxSegments;
+      segment_list recent;
+      unordered_map<uint64_t, cached_segment> cache;
+
+   public:
+
+      uint64_t hits = 0, misses = 0, evictions = 0;
+
+      prime_query_engine(size_t cacheBytes, const sieve_geometry &segmentGeometry = sieve_geometry())
+        : geometry(segmentGeometry), maxSegments(max<size_t>(1, cacheBytes / segmentGeometry.segmentBytes))
+      {
+      }
+
+      uint64_t span() const { return (uint64_t) geometry.segmentBytes * 16; }
+
+      // ensureCovers
+      //
+      // Grows the base primes so that any segment up to and including the one holding n can be sieved.  The
+      // limit quadruples at a time (so the base primes double) and stays a whole number of segments, except that
+      // it stops at UINT64_MAX so the last, partial segment below 2^64 is covered too.
+
+      void ensureCovers(uint64_t n)
+      {
+          uint64_t needed = (n / span() < UINT64_MAX / span()) ? (n / span() + 1) * span() : UINT64_MAX;
+          if (sieve && sieve->size() >= needed)
+              return;
+
+          uint64_t limit = sieve ? sieve->size() : span();
+          while (limit < needed)
+              limit = (limit > UINT64_MAX / 4) ? UINT64_MAX : limit * 4;
+          sieve = make_unique<segmented_sieve>(limit, geometry);
+      }
+
+      bool isPrime(uint64_t n)
+      {
+          if (n < 3 || !(n & 1))
+              return n == 2;
+
+          ensureCovers(n);
+          uint64_t index = n / span();
+          uint64_t low   = index * span();
+          auto found = cache.find(index);
+
+          if (found != cache.end())
+          {
+              hits++;
+              recent.splice(recent.begin(), recent, found->second.age);
+          }
+          else
+          {
+              misses++;
+              if (cache.size() >= maxSegments)
+              {
+                  cache.erase(recent.back());
+                  recent.pop_back();
+                  evictions++;
+              }
+              recent.push_front(index);
+              found = cache.emplace(index, cached_segment()).first;
+              found->second.age = recent.begin();
+              sieve->sieveSegment(low, low + min(span(), sieve->size() - low), found->second.words);
+          }
+
+          uint64_t bit = (n - low) / 2;
+          return found->second.words[bit / 64] >> (bit % 64) & 1;
+      }
+
+      size_t cachedSegments() const { return cache.size(); }
+      size_t basePrimeCount() const { return sieve ? sieve->primes().size() : 0; }
+};
+
+// mulMod64 / isPrimeMillerRabin
+//
+// Deterministic Miller-Rabin for 64-bit n (these twelve bases have no strong pseudoprime below 3.3e24), used
+// only to cross-check sieve answers for numbers far too large to sieve up to.
+
+inline uint64_t mulMod64(uint64_t a, uint64_t b, uint64_t m)
+{
+#ifdef __SIZEOF_INT128__
+    return (uint64_t) ((unsigned __int128) a * b % m);
+#else
+    uint64_t result = 0;
+    a %= m;
+    for (; b; b >>= 1)
+    {
+        if (b & 1)
+            result = (result >= m - a) ? result - (m - a) : result + a;
+        a = (a >= m - a) ? a - (m - a) : a + a;
+    }
+    return result;
+#endif
+}
+
+bool isPrimeMillerRabin(uint64_t n)
+{
+    const uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+    if (n < 2)
+        return false;
+    for (uint64_t p : bases)
+        if (n % p == 0)
+            return n == p;
+
+    uint64_t d = n - 1;
+    unsigned r = 0;
+    for (; !(d & 1); r++)
+        d >>= 1;
+
+    for (uint64_t a : bases)
+    {
+        uint64_t x = 1, base = a, e = d;
+        for (; e; e >>= 1, base = mulMod64(base, base, n))
+            if (e & 1)
+                x = mulMod64(x, base, n);
+        if (x == 1 || x == n - 1)
+            continue;
+
+        bool composite = true;
+        for (unsigned i = 1; i < r && composite; i++)
+        {
+            x = mulMod64(x, x, n);
+            composite = (x != n - 1);
+        }
+        if (composite)
+            return false;
+    }
+    return true;
+}
+
+// answerQueries
+//
+// Offline answers to a batch of isPrime(n) and pi(x) queries (pi counting the primes <= x) with a single
+// segmented sweep instead of a sieve per query.  The queries are sorted by value, the segments up to the largest
+// are split into one contiguous run per thread, and each thread answers the queries that fall in its run as it
+// goes by, keeping a running count of the primes it has seen so far.  A prefix sum over the runs' totals then
+// turns those local counts into pi(x).  If there are no pi queries, segments without a query are skipped.
+// Answers come back in the original order: 0 or 1 for isPrime, the count for pi.
+
+struct prime_query
+{
+    uint64_t value;
+    bool     countQuery;                                        // pi(value) rather than isPrime(value)
+};
+
+vector<uint64_t> answerQueries(const vector<prime_query> &queries, unsigned int cThreads, const sieve_geometry &geometry)
+{
+    vector<uint64_t> answers(queries.size(), 0);
+    if (queries.empty())
+        return answers;
+
+    vector<uint32_t> order(queries.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (uint32_t) i;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return queries[a].value < queries[b].value; });
+
+    bool anyCounts = any_of(queries.begin(), queries.end(), [](const prime_query &q) { return q.countQuery; });
+    segmented_sieve sieve(queries[order.back()].value + 1, geometry);
+    uint64_t span     = sieve.segmentSpan();
+    uint64_t segments = (sieve.size() + span - 1) / span;
+    cThreads = (unsigned int) max<uint64_t>(1, min<uint64_t>(cThreads, segments));
+
+    vector<size_t> runTotals(cThreads, 0);
+    vector<thread> workers;
+
+    for (unsigned int t = 0; t < cThreads; t++)
+    {
+        workers.push_back(thread([&, t]
+        {
+            uint64_t firstSeg = segments * t / cThreads, lastSeg = segments * (t + 1) / cThreads;
+            auto next = lower_bound(order.begin(), order.end(), firstSeg * span,
+                                    [&](uint32_t q, uint64_t v) { return queries[q].value < v; });
+            vector<uint64_t> words;
+            size_t seen = 0;                                    // Odd primes in this run below the current segment
+
+            for (uint64_t seg = firstSeg; seg < lastSeg; seg++)
+            {
+                uint64_t low = seg * span, high = min(sieve.size(), low + span);
+                if (!anyCounts && (next == order.end() || queries[*next].value >= high))
+                    continue;
+
+                size_t bits = sieve.sieveSegment(low, high, words);
+                for (; next != order.end() && queries[*next].value < high; ++next)
+                {
+                    uint64_t n = queries[*next].value;
+                    if (queries[*next].countQuery)
+                        answers[*next] = seen + segmented_sieve::countBits(words, (size_t) ((n + 1 - low) / 2)) + (n >= 2);
+                    else if (n & 1)
+                        answers[*next] = words[(n - low) / 128] >> ((n - low) / 2 % 64) & 1;
+                    else
+                        answers[*next] = (n == 2);
+                }
+                seen += segmented_sieve::countBits(words, bits);
+            }
+            runTotals[t] = seen;
+        }));
+    }
+    for (auto &th : workers)
+        th.join();
+
+    // Add the primes from all earlier runs to each pi answer
+
+    vector<size_t> before(cThreads, 0);
+    for (unsigned int t = 1; t < cThreads; t++)
+        before[t] = before[t - 1] + runTotals[t - 1];
+
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        if (!queries[i].countQuery)
+            continue;
+        uint64_t seg = queries[i].value / span;
+        unsigned int t = 0;
+        while (t + 1 < cThreads && segments * (t + 1) / cThreads <= seg)
+            t++;
+        answers[i] += before[t];
+    }
+    return answers;
+}
+
+// countPrimesUpTo
+//
+// Exact pi(x) without a sieve, by Lucy Hedgehog's recurrence: S(v) starts as the count of 2..v and each prime p
+// up to sqrt(x) removes the numbers whose least prime factor is p, for just the O(sqrt x) distinct values x / i.
+// That's O(x^3/4) time and O(sqrt x) memory, which puts pi(10^12) within a few seconds.
+
+uint64_t countPrimesUpTo(uint64_t x)
+{
+    if (x < 2)
+        return 0;
+
+    uint64_t r = (uint64_t) sqrt((double) x);
+    while (r * r > x)
+        r--;
+    while ((r + 1) * (r + 1) <= x)
+        r++;
+
+    vector<uint64_t> small(r + 1), large(r + 1);                 // S(v) for v <= r, and S(x / i) for i <= r
+    for (uint64_t v = 1; v <= r; v++)
+    {
+        small[v] = v - 1;
+        large[v] = x / v - 1;
+    }
+
+    for (uint64_t p = 2; p <= r; p++)
+    {
+        if (small[p] == small[p - 1])
+            continue;                                           // p isn't prime
+
+        uint64_t sp = small[p - 1], p2 = p * p;
+        uint64_t last = min(r, x / p2);
+        for (uint64_t i = 1; i <= last; i++)
+        {
+            uint64_t d = i * p;
+            large[i] -= ((d <= r) ? large[d] : small[x / d]) - sp;
+        }
+        for (uint64_t v = r; v >= p2; v--)
+            small[v] -= small[v / p] - sp;
+    }
+    return large[1];
+}
+
+// nthPrime
+//
+// The k-th prime (2 being the first).  Rather than sieving all the way up to it, this estimates it by inverting
+// the logarithmic integral, counts the primes up to the estimate exactly with countPrimesUpTo, and then sieves
+// just the segments between the estimate and the answer, forwards or backwards as needed.
+
+double logIntegral(double x)
+{
+    const double EULER_GAMMA = 0.5772156649015329;
+    double lnx = log(x), term = 1, sum = 0;
+    for (int n = 1; n < 200; n++)
+    {
+        term *= lnx / n;
+        sum += term / n;
+        if (term / n < 1e-12 * sum)
+            break;
+    }
+    return EULER_GAMMA + log(lnx) + sum;
+}
+
+uint64_t nthPrime(uint64_t k, const sieve_geometry &geometry = sieve_geometry())
+{
+    const uint64_t firstPrimes[] = { 2, 3, 5, 7, 11 };           // Too few for the estimate below to be any good
+    if (k == 0)
+        return 0;
+    if (k <= 5)
+        return firstPrimes[k - 1];
+
+    double estimate = k * log((double) k);                      // Newton on li(x) = k, starting near k ln k
+    for (int i = 0; i < 40; i++)
+    {
+        double next = estimate - (logIntegral(estimate) - k) * log(estimate);
+        if (fabs(next - estimate) < 1)
+            break;
+        estimate = max(next, 2.0);
+    }
+
+    uint64_t x = (uint64_t) estimate;
+    uint64_t count = countPrimesUpTo(x);                        // pi(x): primes <= x
+
+    // The answer is within a few sqrt(x) log(x) of the estimate; allow plenty and the base primes stay tiny
+
+    segmented_sieve sieve(x + x / 8 + 1'000'000, geometry);
+    uint64_t span = sieve.segmentSpan();
+    vector<uint64_t> words;
+    vector<uint64_t> primes(sieve.segmentWords() * 64 + EXTRACT_SLACK);
+
+    if (count < k)
+    {
+        for (uint64_t low = (x + 1) & ~1ULL; low < sieve.size(); low += span)
+        {
+            sieve.sieveSegment(low, min(sieve.size(), low + span), words);
+            size_t found = extractPrimes(words.data(), words.size(), low, primes.data());
+            for (size_t i = 0; i < found; i++)
+                if (primes[i] > x && ++count == k)
+                    return primes[i];
+        }
+    }
+    else
+    {
+        for (uint64_t high = x + 1; high > 2; )
+        {
+            uint64_t low = (high > span) ? (high - span) & ~1ULL : 0;
+            sieve.sieveSegment(low, high, words);
+            size_t found = extractPrimes(words.data(), words.size(), low, primes.data());
+            for (size_t i = found; i-- > 0; count--)
+                if (count == k)
+                    return primes[i];
+            high = low;
+        }
+    }
+    return 0;                                                   // Only if the estimate was wildly off
+}
+
+// progression_sieve
+//
+// Sieves only the members of one residue class, n = a + q*k for k = 0, 1, 2... below a limit, one bit per member,
+// so both the work and the memory shrink by a factor of q over sieving everything.  A base prime p that doesn't
+// divide q divides exactly the members whose k is congruent to -a * q^-1 (mod p), so its multiples in the class
+// are every p-th bit from an offset worked out once with a modular inverse; a prime that divides q divides all
+// members or none.  The bitmap is processed one cache-sized segment of members at a time.
+
+class progression_sieve
+{
+  private:
+
+      uint64_t a, q, limit;
+      uint64_t cMembers;
+      size_t   segmentBits;
+      vector<uint32_t> basePrimes;                              // Primes up to sqrt(limit) that don't divide q
+      vector<uint32_t> offsets;                                 // p divides a + q*k exactly when k % p == offset
+
+      // inverseMod
+      //
+      // x with x * v == 1 (mod m), for v coprime to m, by the extended Euclidean algorithm
+
+      static uint64_t inverseMod(uint64_t v, uint64_t m)
+      {
+          int64_t r0 = (int64_t) m, r1 = (int64_t) (v % m), t0 = 0, t1 = 1;
+          while (r1)
+          {
+              int64_t quotient = r0 / r1;
+              tie(r0, r1) = make_pair(r1, r0 - quotient * r1);
+              tie(t0, t1) = make_pair(t1, t0 - quotient * t1);
+          }
+          return (uint64_t) (t0 < 0 ? t0 + (int64_t) m : t0);
+      }
+
+      // firstCrossing
+      //
+      // The first k whose member is a multiple of basePrimes[i] other than the prime itself, which is the first
+      // k from the one holding p squared that lands on the prime's offset
+
+      uint64_t firstCrossing(size_t i) const
+      {
+          uint64_t p = basePrimes[i];
+          uint64_t square = p * p;
+          uint64_t k = square <= a ? 0 : (square - a + q - 1) / q;
+          return k + (offsets[i] + p - k % p) % p;
+      }
+
+  public:
+
+      progression_sieve(uint64_t residue, uint64_t modulus, uint64_t n, const sieve_geometry &geometry = sieve_geometry())
+        : a(residue % max<uint64_t>(modulus, 1)), q(max<uint64_t>(modulus, 1)), limit(n),
+          segmentBits(max<size_t>(geometry.segmentBytes, 8) * 8)
+      {
+          cMembers = limit <= a ? 0 : (limit - a + q - 1) / q;
+
+          uint64_t root = (uint64_t) sqrt((double) limit) + 1;
+          prime_sieve small(root + 1);
+          small.runSieve();
+          for (uint64_t p = 2; p <= root; p++)
+          {
+              if (!small.isPrime(p) || q % p == 0)
+                  continue;
+              basePrimes.push_back((uint32_t) p);
+              uint64_t minusA = (p - a % p) % p;
+              offsets.push_back((uint32_t) mulMod64(minusA, inverseMod(q % p, p), p));
+          }
+      }
+
+      uint64_t residue() const  { return a; }
+      uint64_t modulus() const  { return q; }
+      uint64_t members() const  { return cMembers; }
+      uint64_t member(uint64_t k) const { return a + q * k; }
+
+      // sweep
+      //
+      // Sieves the members one segment at a time, calling onSegment(kLow, words, bits) where bit i of 'words'
+      // stands for member kLow + i, set if that member is prime.  Each prime's next crossing is carried from one
+      // segment to the next, so the division that finds it is paid once per sweep rather than once per segment.
+
+      template <typename Callback>
+      void sweep(Callback &&onSegment) const
+      {
+          uint64_t g = gcdConst(a, q);
+          vector<uint64_t> words((segmentBits + 63) / 64);
+          vector<uint64_t> nextK(basePrimes.size());
+          size_t started = 0;                                   // Primes whose nextK has been worked out
+
+          for (uint64_t kLow = 0; kLow < cMembers; kLow += segmentBits)
+          {
+              size_t bits = (size_t) min<uint64_t>(segmentBits, cMembers - kLow);
+              uint64_t kHigh = kLow + bits;
+
+              if (g > 1)
+              {
+                  // Every member shares the factor g, so the only prime there can be is g itself, if it's a member
+
+                  fill(words.begin(), words.end(), 0);
+                  uint64_t only = (a == 0) ? q : a;
+                  if (only == g && isPrimeMillerRabin(only) && (only - a) / q >= kLow && (only - a) / q < kHigh)
+                      words[((only - a) / q - kLow) / 64] |= 1ULL << (((only - a) / q - kLow) % 64);
+              }
+              else
+              {
+                  fill(words.begin(), words.end(), ~0ULL);
+                  uint64_t *data = words.data();
+                  for (size_t i = 0; i < basePrimes.size(); i++)
+                  {
+                      uint64_t p = basePrimes[i];
+                      if (p * p >= member(kHigh - 1) + 1)
+                          break;
+                      if (i == started)
+                          nextK[started++] = firstCrossing(i);
+
+                      uint64_t k = nextK[i] - kLow;
+                      for (; k < bits; k += p)
+                          data[k / 64] &= ~(1ULL << (k % 64));
+                      nextK[i] = kLow + k;
+                  }
+                  for (uint64_t v = a; v <= 1; v += q)               // 0 and 1 may be members but aren't prime
+                      if ((v - a) / q >= kLow && (v - a) / q < kHigh)
+                          words[((v - a) / q - kLow) / 64] &= ~(1ULL << (((v - a) / q - kLow) % 64));
+              }
+
+              if (bits % 64)
+                  words[bits / 64] &= (1ULL << (bits % 64)) - 1;
+              for (size_t w = (bits + 63) / 64; w < words.size(); w++)
+                  words[w] = 0;
+              onSegment(kLow, words, bits);
+          }
+      }
+
+      size_t countPrimes() const
+      {
+          size_t count = 0;
+          sweep([&count](uint64_t, const vector<uint64_t> &words, size_t bits)
+          {
+              count += segmented_sieve::countBits(words, bits);
+          });
+          return count;
+      }
+};
+
+// pi_checkpoints
+//
+// Table of pi at every multiple of a fixed stride, recorded during one segmented sweep and saved to a compact
+// file: a small header followed by the number of primes in each stride as a 32-bit value.  Once loaded, the
+// count of primes below any x within the table's range is the nearest checkpoint plus a sieve of the partial
+// stride up to x, so a 2^20 stride costs at most a couple of segments per query.
+
+class pi_checkpoints
+{
+  private:
+
+      static const uint32_t MAGIC = 0x50435450;                 // "PTCP"
+
+      uint64_t stride = 0;
+      uint64_t limit  = 0;
+      vector<uint64_t> cumulative;                              // cumulative[j] = primes below j * stride
+      unique_ptr<segmented_sieve> sieve;
+
+   public:
+
+      bool loaded() const          { return !cumulative.empty(); }
+      uint64_t coveredLimit() const { return limit; }
+
+      // write
+      //
+      // Sweeps [0, limit) and saves the checkpoints every 'stride' numbers (rounded up to even) to 'path'.
+
+      static bool write(const string &path, uint64_t limit, uint64_t stride, const sieve_geometry &geometry)
+      {
+          stride = max<uint64_t>(2, (stride + 1) & ~1ULL);
+          vector<uint32_t> deltas;
+          uint64_t running = 0, previous = 0, next = stride;
+
+          segmented_sieve(limit, geometry).sweep([&](uint64_t low, uint64_t high, const vector<uint64_t> &words, size_t bits)
+          {
+              for (; next <= high; next += stride)
+              {
+                  uint64_t below = running + segmented_sieve::countBits(words, (size_t) ((next - low) / 2)) + (next > 2);
+                  deltas.push_back((uint32_t) (below - previous));
+                  previous = below;
+              }
+              running += segmented_sieve::countBits(words, bits);
+          });
+
+          FILE *file = fopen(path.c_str(), "wb");
+          if (!file)
+              return false;
+          uint64_t header[3] = { MAGIC, stride, limit };
+          bool ok = fwrite(header, sizeof(header), 1, file) == 1
+                 && fwrite(deltas.data(), sizeof(uint32_t), deltas.size(), file) == deltas.size();
+          return (fclose(file) == 0) && ok;
+      }
+
+      bool load(const string &path, const sieve_geometry &geometry = sieve_geometry())
+      {
+          FILE *file = fopen(path.c_str(), "rb");
+          if (!file)
+              return false;
+
+          uint64_t header[3];
+          bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == MAGIC && header[1] >= 2;
+          cumulative.assign(1, 0);
+          uint32_t delta;
+          while (ok && fread(&delta, sizeof(delta), 1, file) == 1)
+              cumulative.push_back(cumulative.back() + delta);
+          fclose(file);
+
+          if (!ok)
+          {
+              cumulative.clear();
+              return false;
+          }
+          stride = header[1];
+          limit  = header[2];
+          sieve  = make_unique<segmented_sieve>(limit, geometry);
+          return true;
+      }
+
+      // countBelow
+      //
+      // Number of primes below x, for any x up to the limit the table was written for.
+
+      bool countBelow(uint64_t x, size_t &count) const
+      {
+          if (!loaded() || x > limit)
+              return false;
+
+          uint64_t j = min<uint64_t>(x / stride, cumulative.size() - 1);
+          uint64_t low = j * stride;
+          vector<uint64_t> words;
+
+          count = (size_t) cumulative[j] + (low <= 2 && x > 2);
+          for (; low < x; low += sieve->segmentSpan())
+              count += segmented_sieve::countBits(words, sieve->sieveSegment(low, min(x, low + sieve->segmentSpan()), words));
+          return true;
+      }
+};
+
+pi_checkpoints loadedCheckpoints;                               // Filled in by --checkpoints, used by validateCount
+
+bool checkpointCount(uint64_t limit, size_t &count)
+{
+    return loadedCheckpoints.countBelow(limit, count);
+}
+
+// sieve_job / sieve_result
+//
+// One independent piece of work for the sieve_executor: count, and optionally list, the primes in [low, high).
+// Higher priorities run first.  Setting *cancel stops the job at its next segment boundary, in which case the
+// result says so and holds only what was found up to there.  onComplete, if given, runs on the worker thread
+// just before the job's future becomes ready.
+
+struct sieve_result
+{
+    uint64_t         low       = 0;
+    uint64_t         high      = 0;
+    size_t           count     = 0;
+    vector<uint64_t> primes;                                    // Only filled in if the job asked for the list
+    bool             cancelled = false;
+};
+
+struct sieve_job
+{
+    uint64_t low        = 0;
+    uint64_t high       = 0;
+    bool     listPrimes = false;
+    int      priority   = 0;
+    shared_ptr<atomic<bool>>             cancel;
+    function<void(const sieve_result &)> onComplete;
+};
+
+// runSieveJob
+//
+// Sieves just the segments covering [low, high), with base primes up to sqrt(high).  Segments start at low
+// rounded down to even, so the first bit is low itself when low is odd and low + 1 when it's even.
+
+sieve_result runSieveJob(const sieve_job &job, const sieve_geometry &geometry)
+{
+    sieve_result result;
+    result.low  = job.low;
+    result.high = job.high;
+    if (job.high <= job.low)
+        return result;
+
+    if (job.low <= 2 && job.high > 2)                            // The bitmap only holds the odd numbers
+    {
+        result.count++;
+        if (job.listPrimes)
+            result.primes.push_back(2);
+    }
+
+    segmented_sieve sieve(job.high, geometry);
+    uint64_t span = sieve.segmentSpan();
+    vector<uint64_t> words;
+    vector<uint64_t> found(job.listPrimes ? sieve.segmentWords() * 64 + EXTRACT_SLACK : 0);
+
+    for (uint64_t low = job.low & ~1ULL; low < job.high; low += span)
+    {
+        if (job.cancel && job.cancel->load(memory_order_relaxed))
+        {
+            result.cancelled = true;
+            break;
+        }
+
+        size_t bits = sieve.sieveSegment(low, min(job.high, low + span), words);
+        if (job.listPrimes)
+        {
+            size_t cFound = extractPrimes(words.data(), (bits + 63) / 64, low, found.data());
+            result.primes.insert(result.primes.end(), found.begin(), found.begin() + cFound);
+            result.count += cFound;
+        }
+        else
+            result.count += segmented_sieve::countBits(words, bits);
+    }
+    return result;
+}
+
+// sieve_executor
+//
+// Shared pool of worker threads for running many sieve jobs at once without each caller starting threads of its
+// own.  Every worker has its own queue, kept as a heap ordered by priority and then by submission, and submit
+// deals jobs out round-robin.  A worker takes from its own queue first; once that is empty it steals the best job
+// on top of the others' before it goes to sleep.  Destroying the executor finishes every job already queued.
+
+class sieve_executor
+{
+  private:
+
+      struct task
+      {
+          int      priority;
+          uint64_t sequence;
+          function<void()> run;
+
+          bool operator<(const task &other) const               // Heap order: lower priority, then later, sinks
+          {
+              return priority != other.priority ? priority < other.priority : sequence > other.sequence;
+          }
+      };
+
+      struct worker_queue
+      {
+          mutex        lock;
+          vector<task> heap;
+      };
+
+      sieve_geometry geometry;
+      vector<unique_ptr<worker_queue>> queues;
+      vector<thread> workers;
+
+      mutex              idleLock;
+      condition_variable wake;
+      size_t             pending  = 0;                          // Queued jobs, guarded by idleLock
+      bool               stopping = false;
+      atomic<uint64_t>   submitted{0};
+
+      static bool popTop(worker_queue &queue, task &next)
+      {
+          lock_guard<mutex> guard(queue.lock);
+          if (queue.heap.empty())
+              return false;
+          pop_heap(queue.heap.begin(), queue.heap.end());
+          next = move(queue.heap.back());
+          queue.heap.pop_back();
+          return true;
+      }
+
+      // tryTake
+      //
+      // Pops the worker's own queue if it has anything.  Otherwise peeks at the top of every other queue, one lock
+      // at a time, and steals the best of them; if another worker got to that job in between, it looks again.
+
+      bool tryTake(size_t self, task &next)
+      {
+          if (popTop(*queues[self], next))
+              return true;
+
+          for (;;)
+          {
+              size_t   best = queues.size();
+              int      bestPriority = 0;
+              uint64_t bestSequence = 0;
+
+              for (size_t k = 1; k < queues.size(); k++)
+              {
+                  size_t index = (self + k) % queues.size();
+                  auto &queue = *queues[index];
+                  lock_guard<mutex> guard(queue.lock);
+                  if (queue.heap.empty())
+                      continue;
+                  const task &top = queue.heap.front();
+                  if (best == queues.size() || top.priority > bestPriority ||
+                      (top.priority == bestPriority && top.sequence < bestSequence))
+                  {
+                      best         = index;
+                      bestPriority = top.priority;
+                      bestSequence = top.sequence;
+                  }
+              }
+              if (best == queues.size())
+                  return false;
+
+              auto &queue = *queues[best];
+              lock_guard<mutex> guard(queue.lock);
+              if (queue.heap.empty() || queue.heap.front().sequence != bestSequence)
+                  continue;
+              pop_heap(queue.heap.begin(), queue.heap.end());
+              next = move(queue.heap.back());
+              queue.heap.pop_back();
+              return true;
+          }
+      }
+
+      void workerLoop(size_t self)
+      {
+          for (;;)
+          {
+              task next;
+              if (tryTake(self, next))
+              {
+                  {
+                      lock_guard<mutex> guard(idleLock);
+                      pending--;
+                  }
+                  next.run();
+                  continue;
+              }
+
+              unique_lock<mutex> guard(idleLock);
+              wake.wait(guard, [this] { return stopping || pending > 0; });
+              if (stopping && pending == 0)
+                  return;
+          }
+      }
+
+  public:
+
+      sieve_executor(unsigned int threads = thread::hardware_concurrency(), const sieve_geometry &geometry = sieve_geometry())
+        : geometry(geometry)
+      {
+          threads = max(1u, threads);
+          for (unsigned int i = 0; i < threads; i++)
+              queues.push_back(make_unique<worker_queue>());
+          for (unsigned int i = 0; i < threads; i++)
+              workers.push_back(thread([this, i] { workerLoop(i); }));
+      }
+
+      ~sieve_executor()
+      {
+          {
+              lock_guard<mutex> guard(idleLock);
+              stopping = true;
+          }
+          wake.notify_all();
+          for (auto &worker : workers)
+              worker.join();
+      }
+
+      sieve_executor(const sieve_executor &) = delete;
+      sieve_executor &operator=(const sieve_executor &) = delete;
+
+      size_t threadCount() const
+      {
+          return workers.size();
+      }
+
+      future<sieve_result> submit(sieve_job job)
+      {
+          auto promised = make_shared<promise<sieve_result>>();
+          auto result   = promised->get_future();
+          uint64_t sequence = submitted++;
+
+          task queued { job.priority, sequence, [this, job = move(job), promised]
+          {
+              try
+              {
+                  auto done = runSieveJob(job, geometry);
+                  if (job.onComplete)
+                      job.onComplete(done);
+                  promised->set_value(move(done));
+              }
+              catch (...)
+              {
+                  promised->set_exception(current_exception());
+              }
+          }};
+
+          auto &queue = *queues[sequence % queues.size()];
+          {
+              lock_guard<mutex> idle(idleLock);                   // Counted before any worker can take it
+              lock_guard<mutex> guard(queue.lock);
+              queue.heap.push_back(move(queued));
+              push_heap(queue.heap.begin(), queue.heap.end());
+              pending++;
+          }
+          wake.notify_one();
+          return result;
+      }
+};
+
+// sieve_engine
+//
+// Which implementation a benchmark pass runs: the original whole-range prime_sieve, or the segmented sieve.
+
+enum class sieve_engine
+{
+    basic,
+    segmented,
+};
+
+const char *engineName(sieve_engine engine)
+{
+    return engine == sieve_engine::segmented ? "segmented" : "basic";
+}
+
+bool parseEngine(const string &name, sieve_engine &engine)
+{
+    if (name == "basic")
+        engine = sieve_engine::basic;
+    else if (name == "segmented")
+        engine = sieve_engine::segmented;
+    else
+        return false;
+    return true;
+}
+
+// runEnginePass
+//
+// One benchmark pass: sieve everything below the limit with the given engine.  The basic sieve is built on the
+// heap, rather than the stack, due to its possible enormity; the segmented one has to count as it goes since it
+// keeps no more than a segment of results.  With geometry.interleave above one, the basic engine runs that many
+// sieves in lockstep and the pass counts as that many.  Returns the number of sieves run.
+
+size_t runEnginePass(sieve_engine engine, uint64_t limit, const sieve_geometry &geometry)
+{
+    if (engine == sieve_engine::segmented)
+    {
+        segmented_sieve(limit, geometry).countPrimes();
+        return 1;
+    }
+
+    size_t cSieves = max(1u, geometry.interleave);
+    withLayout(geometry.layout, [limit, &geometry, cSieves](auto *tag)
+    {
+        using sieve_type = remove_pointer_t<decltype(tag)>;
+        if (cSieves == 1)
+        {
+            make_unique<sieve_type>(limit, geometry.sieveThreads, geometry.hugePages)->runSieve(geometry.sieveThreads);
+            return;
+        }
+
+        vector<unique_ptr<sieve_type>> owned;
+        vector<sieve_type *> sieves;
+        for (size_t k = 0; k < cSieves; k++)
+        {
+            owned.push_back(make_unique<sieve_type>(limit, geometry.sieveThreads, geometry.hugePages));
+            sieves.push_back(owned.back().get());
+        }
+        sieve_type::runSieves(sieves);
+    });
+    return cSieves;
+}
+
+// passMemoryBytes
+//
+// Roughly what one runEnginePass allocates at its peak: the whole sieve for the basic engine, times the number of
+// sieves it interleaves, and for the segmented one a segment plus the base primes and the small sieve that finds
+// them.
+
+uint64_t passMemoryBytes(sieve_engine engine, uint64_t limit, const sieve_geometry &geometry)
+{
+    if (engine == sieve_engine::segmented)
+    {
+        uint64_t root = (uint64_t) sqrt((double) limit) + 1;
+        uint64_t cBasePrimes = root < 16 ? 8 : (uint64_t) (1.26 * root / log((double) root));  // Bounds pi(root)
+        return geometry.segmentBytes + cBasePrimes * sizeof(uint32_t) + prime_sieve::memoryBytes(root + 1);
+    }
+
+    uint64_t bytes = 0;
+    withLayout(geometry.layout, [&](auto *tag) { bytes = remove_pointer_t<decltype(tag)>::memoryBytes(limit); });
+    return bytes * max(1u, geometry.interleave);
+}
+
+// peakRssBytes
+//
+// The most physical memory this process has had resident so far, or 0 where we can't ask.
+
+uint64_t peakRssBytes()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t) usage.ru_maxrss;                          // Already in bytes on macOS
+#else
+    return (uint64_t) usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// planMemory
+//
+// Fits a benchmark run into a memory budget, less what the process already holds.  Every thread has one pass in
+// flight at a time, so the thread count is cut to as many passes as fit.  If the basic engine can't keep all
+// the threads busy and the engine wasn't picked explicitly, the segmented engine, which needs little more than a
+// segment per thread, takes over.  Returns false if not even one pass fits.
+
+bool planMemory(uint64_t budget, uint64_t limit, const sieve_geometry &geometry, bool bEngineFixed,
+                sieve_engine &engine, unsigned int &threads)
+{
+    uint64_t available = budget > peakRssBytes() ? budget - peakRssBytes() : 0;
+    auto passesThatFit = [&](sieve_engine candidate)
+    {
+        uint64_t perPass = max<uint64_t>(1, passMemoryBytes(candidate, limit, geometry));
+        return (unsigned int) min<uint64_t>(threads, available / perPass);
+    };
+
+    if (!bEngineFixed && engine == sieve_engine::basic && passesThatFit(sieve_engine::basic) < threads)
+        engine = sieve_engine::segmented;
+
+    unsigned int cFit = passesThatFit(engine);
+    if (!cFit)
+        return false;
+    threads = cFit;
+    return true;
+}
+
+// currentCpu
+//
+// The CPU the calling thread is running on at this moment, or -1 where the OS won't say.
+
+int currentCpu()
+{
+#if defined(_WIN32)
+    return (int) GetCurrentProcessorNumber();
+#elif defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+// thread_pass_stats
+//
+// What one runPasses worker got through: its pass count, total and extreme pass times, a histogram of pass
+// latency where bucket b counts passes of 2^b to 2^(b+1) microseconds, a random sample of the latencies themselves
+// for --baseline to test, and the CPUs it was seen on (sampled after every pass, so a thread the scheduler moved
+// around lists several).
+
+struct thread_pass_stats
+{
+    static const size_t BUCKETS = 40;
+    static const size_t SAMPLES = 4096;
+
+    size_t      passes  = 0;
+    double      seconds = 0;
+    double      fastest = 0;
+    double      slowest = 0;
+    size_t      histogram[BUCKETS] = {};
+    vector<int> cpus;
+    vector<double> samples;                                     // A uniform sample of at most SAMPLES latencies
+    minstd_rand    sampler;
+
+    void record(double latency, int cpu)
+    {
+        fastest = passes ? min(fastest, latency) : latency;
+        slowest = max(slowest, latency);
+        seconds += latency;
+        passes++;
+
+        if (samples.size() < SAMPLES)                           // Reservoir sampling keeps memory flat however
+            samples.push_back(latency);                         // many passes a tiny limit runs
+        else if (sampler() % passes < SAMPLES)
+            samples[sampler() % SAMPLES] = latency;
+
+        size_t bucket = 0;
+        for (double us = latency * 1e6; us >= 2 && bucket + 1 < BUCKETS; us /= 2)
+            bucket++;
+        histogram[bucket]++;
+
+        if (find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+            cpus.push_back(cpu);
+    }
+
+    double meanLatency() const
+    {
+        return passes ? seconds / passes : 0;
+    }
+};
+
+// runPasses
+//
+// Keeps cThreads threads busy with passes until at least 'seconds' have elapsed, and returns how many passes ran.
+// Each thread runs its passes back to back rather than meeting the others at a barrier after each one, so a
+// thread stuck on a slow or busy core shows up as one that got through fewer passes, in 'stats' if given.  If
+// 'pinning' lists CPUs, worker i is pinned to the i-th of them; workers past the end of the list, like all of
+// them without one, are left for the OS to place rather than doubled up on a CPU that's already taken.
+
+size_t runPasses(sieve_engine engine, uint64_t limit, const sieve_geometry &geometry, unsigned int cThreads, double seconds,
+                 vector<thread_pass_stats> *stats = nullptr, const vector<int> &pinning = {})
+{
+    vector<thread_pass_stats> workerStats(cThreads);
+    vector<thread> threadPool;
+    auto tStart = steady_clock::now();
+
+    for (unsigned int i = 0; i < cThreads; i++)
+    {
+        threadPool.push_back(thread([&, i]
+        {
+            if (i < pinning.size())
+                pinCurrentThread(pinning[i]);
+
+            auto &mine  = workerStats[i];
+            auto  tPass = steady_clock::now();
+            while (duration_cast<microseconds>(tPass - tStart).count() < seconds * 1000000)
+            {
+                size_t cSieves = runEnginePass(engine, limit, geometry);
+                auto tDone = steady_clock::now();
+                for (size_t k = 0; k < cSieves; k++)             // Interleaved sieves share the time evenly
+                    mine.record(duration_cast<duration<double>>(tDone - tPass).count() / cSieves, currentCpu());
+                tPass = tDone;
+            }
+        }));
+    }
+
+    for (auto &th : threadPool) 
+        th.join();
+
+    size_t cPasses = 0;
+    for (auto &worker : workerStats)
+        cPasses += worker.passes;
+    if (stats)
+        *stats = move(workerStats);
+    return cPasses;
+}
+
+// reportThreadSpread
+//
+// Sums up how evenly the runPasses threads fared: the spread of their pass counts, and every thread whose mean
+// pass took more than stragglerPercent longer than the median thread's, along with the CPUs it ran on.  With
+// 'detail' every thread is listed along with its latency histogram.  Returns the number of stragglers.
+
+size_t reportThreadSpread(const vector<thread_pass_stats> &stats, double stragglerPercent, bool detail)
+{
+    if (stats.empty())
+        return 0;
+
+    vector<size_t> passes;
+    vector<double> means;
+    for (auto &worker : stats)
+    {
+        passes.push_back(worker.passes);
+        if (worker.passes)
+            means.push_back(worker.meanLatency());
+    }
+    sort(passes.begin(), passes.end());
+    sort(means.begin(), means.end());
+    double medianMean = means.empty() ? 0 : means[means.size() / 2];
+
+    auto cpuList = [](const thread_pass_stats &worker)
+    {
+        string list;
+        for (int cpu : worker.cpus)
+            list += (list.empty() ? "" : ",") + (cpu < 0 ? string("?") : to_string(cpu));
+        return list;
+    };
+
+    size_t cStragglers = 0;
+    for (size_t t = 0; t < stats.size(); t++)
+    {
+        auto &worker  = stats[t];
+        double slower = medianMean > 0 && worker.passes ? 100.0 * (worker.meanLatency() / medianMean - 1) : 0;
+        bool straggler = slower > stragglerPercent;
+        cStragglers += straggler;
+
+        if (!straggler && !detail)
+            continue;
+
+        printf("  %sThread %zu on cpu %s: %zu passes, mean %.3f ms (min %.3f, max %.3f), %+.1f%% vs median",
+               straggler ? "STRAGGLER " : "", t, cpuList(worker).c_str(), worker.passes,
+               worker.meanLatency() * 1e3, worker.fastest * 1e3, worker.slowest * 1e3, slower);
+        if (detail)
+        {
+            printf(" |");                                        // Bucket b is labelled with its upper bound
+            for (size_t b = 0; b < thread_pass_stats::BUCKETS; b++)
+                if (worker.histogram[b])
+                    printf(" <%lluus:%zu", 1ULL << (b + 1), worker.histogram[b]);
+        }
+        printf("\n");
+    }
+
+    printf("Thread spread: passes min %zu / median %zu / max %zu, median pass %.3f ms, %zu straggler%s over %.0f%%\n",
+           passes.front(), passes[passes.size() / 2], passes.back(), medianMean * 1e3,
+           cStragglers, cStragglers == 1 ? "" : "s", stragglerPercent);
+    return cStragglers;
+}
+
+// runSmtTrial
+//
+// Settles --smt auto: runs passes briefly with one worker per physical core and then with one per logical CPU,
+// each pinned, and keeps whichever placement got through more passes per second.  An explicit thread count is
+// kept either way.  Returns the thread count to use and leaves the winning placement in 'pinning'.
+
+unsigned int runSmtTrial(sieve_engine engine, uint64_t limit, const sieve_geometry &geometry, const cpu_topology &topology,
+                         unsigned int cThreadsRequested, double seconds, vector<int> &pinning)
+{
+    double trialSeconds = max(0.25, seconds / 10);
+    double bestRate     = -1;
+    unsigned int cBest  = 0;
+
+    for (bool smt : { false, true })
+    {
+        auto cpus = topology.placement(smt);
+        unsigned int cThreads = cThreadsRequested ? cThreadsRequested : (unsigned int) cpus.size();
+
+        auto tTrial = steady_clock::now();
+        size_t cPasses = runPasses(engine, limit, geometry, cThreads, trialSeconds, nullptr, cpus);
+        double rate = cPasses / duration_cast<duration<double>>(steady_clock::now() - tTrial).count();
+
+        printf("SMT %-3s: %u thread%s, %.1f passes/sec", smt ? "on" : "off", cThreads, cThreads == 1 ? "" : "s", rate);
+        if (cThreads > cpus.size())
+            printf(" (%zu unpinned)", cThreads - cpus.size());
+        printf("\n");
+        if (rate > bestRate)
+        {
+            bestRate = rate;
+            cBest    = cThreads;
+            pinning  = cpus;
+        }
+    }
+
+    printf("SMT auto picked %u thread%s.\n", cBest, cBest == 1 ? "" : "s");
+    return cBest;
+}
+
+// microBenchmark
+//
+// Minimal self-contained benchmark harness.  Calls the kernel once to warm up, then repeatedly until at least
+// minSeconds have passed, and prints the mean time per call along with the rate at which the kernel got through
+// the items it reports handling (numbers initialized, multiples crossed off, lookups, primes extracted...).
+
+volatile uint64_t benchmarkSink;                                // Kernels store results here to stay observable
+
+template <typename Kernel>
+void microBenchmark(const char *kernel, const char *engine, uint64_t limit, double minSeconds, Kernel &&run)
+{
+    run();
+
+    uint64_t calls = 0;
+    uint64_t items = 0;
+    auto tStart = steady_clock::now();
+    double elapsed = 0;
+    do
+    {
+        items += run();
+        calls++;
+        elapsed = duration_cast<nanoseconds>(steady_clock::now() - tStart).count() / 1e9;
+    } while (elapsed < minSeconds);
+
+    printf("%-14s %-10s %14llu %10llu %16.1lf %14.2lf\n",
+           kernel,
+           engine,
+           (unsigned long long) limit,
+           (unsigned long long) calls,
+           elapsed * 1e9 / calls,
+           items / elapsed / 1e6);
+}
+
+// runMicrobench
+//
+// Times each sieve kernel in isolation for both engines at limits from 10^4 up to the requested limit, so a
+// regression in one phase shows up even when the end-to-end pass count hides it.  The basic engine runs with
+// the chosen layout.  Crossing-off is split into small primes (several hits per word) and the rest, which are
+// medium primes (several hits per segment): the large tier past the medium bound only begins at limits around
+// 1.5e11 with the default segment, beyond anything this harness can sieve whole, so it isn't timed apart.
+
+int runMicrobench(uint64_t llUpperLimit, double minSeconds, const sieve_geometry &geometry)
+{
+    vector<uint64_t> limits;
+    for (uint64_t limit = 10'000; limit < llUpperLimit; limit *= 100)
+        limits.push_back(limit);
+    limits.push_back(llUpperLimit);
+
+    printf("Basic engine layout: %s storage, wheel %u, %u-bit index.\n",
+           geometry.layout.storage.c_str(), geometry.layout.wheel, geometry.layout.indexBits);
+    printf("%-14s %-10s %14s %10s %16s %14s\n", "Kernel", "Engine", "Limit", "Calls", "ns/call", "Mitems/s");
+
+    for (uint64_t limit : limits)
+    {
+        segmented_sieve segmented(limit, geometry);
+        const vector<uint32_t> &primes = segmented.primes();
+
+        // Tier boundaries as indices into the base primes, and the multiples each tier crosses off in total
+
+        size_t tiers[3] = { 0, segmented.smallTierEnd(), primes.size() };
+        const char *tierNames[2] = { "cross-small", "cross-medium" };
+
+        withLayout(geometry.layout, [&](auto *tag)
+        {
+            using sieve_type = remove_pointer_t<decltype(tag)>;
+            if (limit > sieve_type::maxLimit())
+                return;
+
+            sieve_type basic(limit);
+            basic.runSieve();
+
+            microBenchmark("init", "basic", limit, minSeconds, [limit]
+            {
+                sieve_type fresh(limit);
+                benchmarkSink = fresh.isPrime(limit - 1);
+                return limit;
+            });
+            microBenchmark("search", "basic", limit, minSeconds, [&basic, limit]
+            {
+                uint64_t q = (uint64_t) sqrt((double) limit), factors = 0;
+                for (uint64_t factor = 3; factor <= q; factor += 2, factors++)
+                    factor = basic.nextFactor(factor);
+                benchmarkSink = factors;
+                return factors;
+            });
+            for (int tier = 0; tier < 2; tier++)
+            {
+                // Primes dividing the wheel have no candidates to cross; the rest cross factor * m for every
+                // candidate m from the factor up
+
+                vector<uint64_t> factors;
+                uint64_t crossings = 0;
+                for (size_t k = tiers[tier]; k < tiers[tier + 1]; k++)
+                {
+                    uint64_t p = primes[k];
+                    if (geometry.layout.wheel % p == 0)
+                        continue;
+                    factors.push_back(p);
+                    crossings += sieve_type::candidatesBelow((limit - 1) / p + 1) - sieve_type::candidatesBelow(p);
+                }
+                if (factors.empty())
+                    continue;
+                microBenchmark(tierNames[tier], "basic", limit, minSeconds, [&basic, &factors, crossings]
+                {
+                    for (uint64_t factor : factors)
+                        basic.crossOff(factor);
+                    return max<uint64_t>(crossings, 1);
+                });
+            }
+            microBenchmark("count", "basic", limit, minSeconds, [&basic, limit]
+            {
+                benchmarkSink = basic.countPrimes();
+                return limit;
+            });
+            microBenchmark("isPrime", "basic", limit, minSeconds, [&basic, limit]
+            {
+                const uint64_t LOOKUPS = 1 << 16;
+                uint64_t state = 0x9e3779b97f4a7c15ULL, found = 0;
+                for (uint64_t n = 0; n < LOOKUPS; n++)
+                {
+                    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                    found += basic.isPrime((state >> 11) % limit);
+                }
+                benchmarkSink = found;
+                return LOOKUPS;
+            });
+        });
+
+        // The segmented kernels work on the last segment below the limit, where every tier has work to do
+
+        uint64_t high = limit;
+        uint64_t low  = (limit > segmented.segmentSpan()) ? (limit - segmented.segmentSpan() + 1) & ~1ULL : 0;
+        vector<uint64_t> words;
+        size_t bits = segmented.sieveSegment(low, high, words);
+
+        microBenchmark("init", "segmented", limit, minSeconds, [&]
+        {
+            words.assign(segmented.segmentWords(), ~0ULL);
+            benchmarkSink = words.back();
+            return (uint64_t) segmented.segmentSpan();
+        });
+        for (int tier = 0; tier < 2; tier++)
+        {
+            if (tiers[tier] == tiers[tier + 1])
+                continue;
+            uint64_t crossings = 0;
+            for (size_t k = tiers[tier]; k < tiers[tier + 1]; k++)
+                crossings += (high - min(high, max<uint64_t>(low, (uint64_t) primes[k] * primes[k]))) / (2 * primes[k]);
+            microBenchmark(tierNames[tier], "segmented", limit, minSeconds, [&, tier, crossings]
+            {
+                segmented.crossOff(low, high, words, tiers[tier], tiers[tier + 1]);
+                return max<uint64_t>(crossings, 1);
+            });
+        }
+        bits = segmented.sieveSegment(low, high, words);
+        microBenchmark("count", "segmented", limit, minSeconds, [&]
+        {
+            benchmarkSink = segmented_sieve::countBits(words, bits);
+            return (uint64_t) bits * 2;
+        });
+
+        vector<uint64_t> out64(words.size() * 64 + EXTRACT_SLACK);
+        vector<uint32_t> out32(words.size() * 64 + EXTRACT_SLACK);
+        microBenchmark("extract64", "segmented", limit, minSeconds, [&]
+        {
+            size_t found = extractPrimes(words.data(), words.size(), low, out64.data());
+            benchmarkSink = out64[found / 2];
+            return (uint64_t) found;
+        });
+        microBenchmark("extract32", "segmented", limit, minSeconds, [&]
+        {
+            size_t found = extractPrimes(words.data(), words.size(), 0, out32.data());
+            benchmarkSink = out32[found / 2];
+            return (uint64_t) found;
+        });
+    }
+    return 0;
+}
+
+// cache_evictor
+//
+// Pushes everything the last pass left behind out of the data caches, so the next pass starts cold the way a sieve
+// does in a process that hasn't run one lately.  The sweep reads and writes every line of a buffer twice the size
+// of the last level cache.  There's no clflush of the sieve itself since every pass allocates its buffers afresh,
+// so once the sweep has displaced last pass's lines there's nothing of it left to flush.
+
+class cache_evictor
+{
+  private:
+
+      static const size_t LINE_BYTES = 64;                      // Touching one byte per line is enough
+
+      vector<uint8_t> sweepBuffer;
+
+  public:
+
+      cache_evictor(const cache_topology &caches)
+        : sweepBuffer(min<size_t>(max<size_t>(2 * max(caches.l3, caches.l2), 8 << 20), (size_t) 1 << 30), 1)
+      {
+      }
+
+      size_t sweepBytes() const
+      {
+          return sweepBuffer.size();
+      }
+
+      void evict()
+      {
+          uint8_t *data = sweepBuffer.data();
+          for (size_t i = 0; i < sweepBuffer.size(); i += LINE_BYTES)
+              data[i]++;
+          benchmarkSink = data[0];
+      }
+};
+
+// runCacheModes
+//
+// --cache cold: times single-threaded passes with the caches left warm by the previous pass and then with them
+// evicted before every pass (outside the timed region), and shows the two side by side.  The difference is the
+// cost of fetching the sieve buffer and base primes from memory, which is largest once they outgrow L2.
+
+int runCacheModes(sieve_engine engine, uint64_t limit, double seconds, const cache_topology &caches, const sieve_geometry &geometry)
+{
+    cache_evictor evictor(caches);
+    printf("Eviction sweep: %zu MB between cold passes.\n", evictor.sweepBytes() >> 20);
+
+    vector<double> latencies[2];                                 // Warm, then cold
+    for (int cold = 0; cold < 2; cold++)
+    {
+        runEnginePass(engine, limit, geometry);                  // Settle the allocator before either run
+        auto tMode = steady_clock::now();
+        while (duration_cast<duration<double>>(steady_clock::now() - tMode).count() < seconds / 2)
+        {
+            if (cold)
+                evictor.evict();
+            auto tPass = steady_clock::now();
+            runEnginePass(engine, limit, geometry);
+            latencies[cold].push_back(duration_cast<duration<double>>(steady_clock::now() - tPass).count());
+        }
+    }
+
+    double median[2];
+    for (int cold = 0; cold < 2; cold++)
+    {
+        auto &times = latencies[cold];
+        sort(times.begin(), times.end());
+        median[cold] = times[times.size() / 2];
+        printf("%s: %6zu passes, median %10.6f s, min %10.6f s, p90 %10.6f s\n",
+               cold ? "Cold" : "Warm",
+               times.size(),
+               median[cold],
+               times.front(),
+               times[times.size() * 9 / 10]);
+    }
+    printf("Cold/warm median: %.3fx, Limit: %llu, Engine: %s\n",
+           median[0] > 0 ? median[1] / median[0] : 0,
+           (unsigned long long) limit,
+           engineName(engine));
+    return 0;
+}
+
+// runJobs
+//
+// Splits [0, limit) into 'cJobs' ranges and counts them as independent jobs on a shared executor, later ranges
+// (which sieve slowest) at higher priority, then adds up the counts from their futures.
+
+int runJobs(uint64_t llUpperLimit, uint64_t cJobs, unsigned int cThreads, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+    atomic<uint64_t> cCompleted{0};
+    vector<future<sieve_result>> results;
+    {
+        sieve_executor executor(cThreads, geometry);
+        uint64_t width = (llUpperLimit / cJobs + 1) & ~1ULL;
+        for (uint64_t i = 0; i < cJobs; i++)
+        {
+            sieve_job job;
+            job.low        = min(llUpperLimit, i * width);
+            job.high       = (i + 1 == cJobs) ? llUpperLimit : min(llUpperLimit, (i + 1) * width);
+            job.priority   = (int) i;
+            job.onComplete = [&cCompleted](const sieve_result &) { cCompleted++; };
+            results.push_back(executor.submit(job));
+        }
+    }
+
+    size_t count = 0;
+    for (auto &result : results)
+        count += result.get().count;
+    auto tJobs = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    auto bKnown = hasExpectedCount(llUpperLimit);
+    printf("Jobs: %llu, Completed: %llu, Threads: %u, Time: %lf, Limit: %llu, Count: %zu, Valid : %s\n",
+           (unsigned long long) cJobs,
+           (unsigned long long) cCompleted.load(),
+           cThreads,
+           tJobs,
+           (unsigned long long) llUpperLimit,
+           count,
+           !bKnown ? "n/a" : validateCount(llUpperLimit, count) ? "Pass" : "FAIL!");
+    return (!bKnown || validateCount(llUpperLimit, count)) ? 0 : 1;
+}
+
+// runProgression
+//
+// Counts (and with -p prints) the primes n = a (mod q) below the limit with a progression_sieve, then checks
+// the count against a full segmented sweep that keeps only the primes in the class.
+
+int runProgression(uint64_t llUpperLimit, uint64_t a, uint64_t q, bool bPrintPrimes, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+    progression_sieve sieve(a, q, llUpperLimit, geometry);
+    size_t count = 0;
+    sieve.sweep([&](uint64_t kLow, const vector<uint64_t> &words, size_t bits)
+    {
+        count += segmented_sieve::countBits(words, bits);
+        if (bPrintPrimes)
+            for (size_t i = 0; i < bits; i++)
+                if (words[i / 64] >> (i % 64) & 1)
+                    printf("%llu, ", (unsigned long long) sieve.member(kLow + i));
+    });
+    if (bPrintPrimes)
+        printf("\n");
+    auto tProgression = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    tStart = steady_clock::now();
+    size_t expected = 0;
+    segmented_sieve full(llUpperLimit, geometry);
+    if (llUpperLimit > 2 && 2 % sieve.modulus() == sieve.residue())
+        expected++;
+    full.sweep([&](uint64_t low, uint64_t, const vector<uint64_t> &words, size_t)
+    {
+        segmented_sieve::forEachPrime(words, low, [&](uint64_t n) { expected += (n % sieve.modulus() == sieve.residue()); });
+    });
+    auto tFull = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    printf("Progression: %llu mod %llu, Members: %llu, Time: %lf (full sieve %lf), Limit: %llu, Count: %zu, Valid : %s\n",
+           (unsigned long long) sieve.residue(),
+           (unsigned long long) sieve.modulus(),
+           (unsigned long long) sieve.members(),
+           tProgression,
+           tFull,
+           (unsigned long long) llUpperLimit,
+           count,
+           count == expected ? "Pass" : "FAIL!");
+    return count == expected ? 0 : 1;
+}
+
+// runInterleave
+//
+// Measures the basic engine's throughput on cThreads threads with each thread running one sieve at a time and
+// then with each running K sieves in lockstep, half the time each, and reports passes per second side by side,
+// along with the peak RSS when there's a memory budget to hold it to.
+
+int runInterleave(uint64_t llUpperLimit, unsigned int K, unsigned int cThreads, double seconds, const sieve_geometry &geometry,
+                  uint64_t ullMaxMemory)
+{
+    double rate[2];
+    for (int interleaved = 0; interleaved < 2; interleaved++)
+    {
+        auto trial = geometry;
+        trial.interleave = interleaved ? K : 1;
+
+        auto tTrial = steady_clock::now();
+        size_t cPasses = runPasses(sieve_engine::basic, llUpperLimit, trial, cThreads, seconds / 2);
+        rate[interleaved] = cPasses / duration_cast<duration<double>>(steady_clock::now() - tTrial).count();
+
+        printf("%-16s %u thread%s x %u sieve%s: %8zu passes, %10.2f passes/sec\n",
+               interleaved ? "Interleaved:" : "Multithreaded:",
+               cThreads, cThreads == 1 ? "" : "s",
+               trial.interleave, trial.interleave == 1 ? "" : "s",
+               cPasses,
+               rate[interleaved]);
+    }
+    printf("Interleaved/multithreaded: %.3fx, Limit: %llu\n", rate[0] > 0 ? rate[1] / rate[0] : 0, (unsigned long long) llUpperLimit);
+    if (ullMaxMemory)
+        printf("Peak RSS: %llu MB of a %llu MB budget.\n",
+               (unsigned long long) (peakRssBytes() >> 20),
+               (unsigned long long) (ullMaxMemory >> 20));
+    return 0;
+}
+
+// runBatch
+//
+// Makes a single segmented sweep up to the limit and reports every historical limit it passes on the way.
+
+int runBatch(uint64_t llUpperLimit, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+
+    vector<uint64_t> limits;
+    for (auto &entry : resultsDictionary)
+        if (entry.first <= llUpperLimit)
+            limits.push_back(entry.first);
+    limits.push_back(llUpperLimit);
+
+    auto results = batchSieve(limits, geometry);
+    auto tBatch  = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+    auto bValid  = true;
+
+    for (auto &result : results)
+    {
+        auto bKnown = hasExpectedCount(result.limit);                 // No reference data, nothing to check
+        cout << "Limit: " << result.limit << ", "
+             << "Count: " << result.count << ", "
+             << "Valid : " << (!bKnown ? "n/a" : result.valid ? "Pass" : "FAIL!") << "\n";
+        bValid = bValid && (result.valid || !bKnown);
+    }
+    cout << "Batch of " << results.size() << " limits, Time: " << tBatch << "\n";
+    return bValid ? 0 : 1;
+}
+
+// runStream
+//
+// Pulls every prime below the limit out of a prime_generator, optionally printing them, and reports the rate.
+
+int runStream(uint64_t llUpperLimit, bool bPrintPrimes, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+    size_t count = 0;
+    uint64_t sum = 0;
+
+    for (uint64_t prime : prime_generator(llUpperLimit, geometry))
+    {
+        if (bPrintPrimes)
+            cout << prime << ", ";
+        count++;
+        sum += prime;
+    }
+    if (bPrintPrimes)
+        cout << "\n";
+
+    auto tStream = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+    auto bKnown  = hasExpectedCount(llUpperLimit);
+    auto bValid  = validateCount(llUpperLimit, count);
+    cout << "Streamed: " << count << ", "
+         << "Sum: " << sum << ", "
+         << "Time: " << tStream << ", "
+         << "Limit: " << llUpperLimit << ", "
+         << "Valid : " << (!bKnown ? "n/a" : bValid ? "Pass" : "FAIL!")
+         << "\n";
+    return (bValid || !bKnown) ? 0 : 1;
+}
+
+// runPipeline
+//
+// Sieves on cThreads producer threads while separate stages count the primes, track the largest gap between
+// consecutive primes, checksum them and delta-encode them (to szOutput, if given).
+
+int runPipeline(uint64_t llUpperLimit, unsigned int cThreads, const string &szOutput, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+
+    segmented_sieve sieve(llUpperLimit, geometry);
+    sieve_pipeline pipeline(sieve, cThreads);
+
+    size_t   count    = (llUpperLimit > 2);
+    uint64_t previous = 2, maxGap = 0, gapStart = 0;
+    uint64_t checksum = 0xcbf29ce484222325ULL;                  // FNV-1a over the primes, 2 included
+    uint64_t encoded  = 0;
+    FILE    *output   = szOutput.empty() ? nullptr : fopen(szOutput.c_str(), "wb");
+
+    if (!szOutput.empty() && !output)
+    {
+        fprintf(stderr, "Cannot open %s for writing\n", szOutput.c_str());
+        return 1;
+    }
+    if (llUpperLimit > 2)
+        checksum = (checksum ^ 2) * 0x100000001b3ULL;
+
+    pipeline.addStage([&](const segment_buffer &buffer)
+    {
+        count += segmented_sieve::countBits(buffer.words, buffer.bits);
+    });
+    pipeline.addStage([&](const segment_buffer &buffer)
+    {
+        segmented_sieve::forEachPrime(buffer.words, buffer.low, [&](uint64_t prime)
+        {
+            if (prime - previous > maxGap)
+            {
+                maxGap   = prime - previous;
+                gapStart = previous;
+            }
+            previous = prime;
+        });
+    });
+    pipeline.addStage([&](const segment_buffer &buffer)
+    {
+        segmented_sieve::forEachPrime(buffer.words, buffer.low, [&](uint64_t prime)
+        {
+            checksum = (checksum ^ prime) * 0x100000001b3ULL;
+        });
+    });
+
+    // Primes are written as half the gap from the previous odd prime, in LEB128 varints
+
+    uint64_t lastEncoded = 1;
+    vector<uint8_t> bytes;
+    pipeline.addStage([&](const segment_buffer &buffer)
+    {
+        bytes.clear();
+        segmented_sieve::forEachPrime(buffer.words, buffer.low, [&](uint64_t prime)
+        {
+            uint64_t delta = (prime - lastEncoded) / 2;
+            lastEncoded = prime;
+            do
+            {
+                bytes.push_back((uint8_t) ((delta & 0x7f) | (delta > 0x7f ? 0x80 : 0)));
+                delta >>= 7;
+            } while (delta);
+        });
+        encoded += bytes.size();
+        if (output)
+            fwrite(bytes.data(), 1, bytes.size(), output);
+    });
+
+    pipeline.run();
+    if (output)
+        fclose(output);
+
+    auto tPipeline = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+    auto bKnown    = hasExpectedCount(llUpperLimit);
+    auto bValid    = validateCount(llUpperLimit, count);
+    printf("Producers: %u, Count: %zu, MaxGap: %llu after %llu, Checksum: %016llx, Encoded: %llu bytes, Time: %lf, Valid : %s\n",
+           cThreads,
+           count,
+           (unsigned long long) maxGap,
+           (unsigned long long) gapStart,
+           (unsigned long long) checksum,
+           (unsigned long long) encoded,
+           tPipeline,
+           !bKnown ? "n/a" : bValid ? "Pass" : "FAIL!");
+    return (bValid || !bKnown) ? 0 : 1;
+}
+
+// runEliasFano
+//
+// Builds the compressed prime store for the limit, reports its footprint and checks random access and
+// successor queries against a fresh stream of the same primes.
+
+int runEliasFano(uint64_t llUpperLimit, const sieve_geometry &geometry)
+{
+    auto tStart = steady_clock::now();
+    elias_fano_primes store(llUpperLimit, geometry);
+    auto tBuild = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    tStart = steady_clock::now();
+    auto bValid = true;
+    size_t k = 0;
+    uint64_t previous = 0, found = 0;
+    for (uint64_t prime : prime_generator(llUpperLimit, geometry))
+    {
+        bValid = bValid && k < store.size() && store[k] == prime;
+        bValid = bValid && store.successor(previous + 1, found) && found == prime;
+        previous = prime;
+        k++;
+    }
+    bValid = bValid && k == store.size() && !store.successor(previous + 1, found);
+    auto tCheck = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    printf("Primes: %zu, Memory: %zu bytes (%.2lf bits/prime, bitmap %llu bytes), Build: %lf, Queries: %lf, Valid : %s\n",
+           store.size(),
+           store.memoryBytes(),
+           store.size() ? 8.0 * store.memoryBytes() / store.size() : 0.0,
+           (unsigned long long) (llUpperLimit / 16),
+           tBuild,
+           tCheck,
+           bValid ? "Pass" : "FAIL!");
+    return bValid ? 0 : 1;
+}
+
+// tuned_config
+//
+// The best engine, segment size, thread count, SMT placement and huge page setting found by --autotune for one
+// limit on one host.  Profiles are plain text, one "limit engine segmentBytes threads passesPerSecond smt
+// hugePages" line per limit tuned; the last two may be missing from older profiles, meaning unpinned threads and
+// ordinary pages.
+
+struct tuned_config
+{
+    uint64_t     limit        = 0;
+    sieve_engine engine       = sieve_engine::basic;
+    size_t       segmentBytes = 0;
+    unsigned int threads      = 1;
+    double       rate         = 0;                              // Passes per second when it was tuned
+    string       smt          = "none";                         // --smt placement, or none for unpinned threads
+    bool         hugePages    = false;
+};
+
+// defaultProfilePath
+//
+// ~/.primecpp_par.<hostname>, or the same name in the current directory if there's no home directory
+
+string defaultProfilePath()
+{
+    char host[256] = "unknown";
+#ifdef _WIN32
+    if (getenv("COMPUTERNAME"))
+        snprintf(host, sizeof(host), "%s", getenv("COMPUTERNAME"));
+    const char *home = getenv("USERPROFILE");
+#else
+    gethostname(host, sizeof(host) - 1);
+    const char *home = getenv("HOME");
+#endif
+    return string(home ? home : ".") + "/.primecpp_par." + host;
+}
+
+vector<tuned_config> loadProfile(const string &path)
+{
+    vector<tuned_config> configs;
+    ifstream file(path);
+    string line, engine;
+    while (getline(file, line))
+    {
+        istringstream fields(line);
+        tuned_config config;
+        if (fields >> config.limit >> engine >> config.segmentBytes >> config.threads >> config.rate
+            && parseEngine(engine, config.engine))
+        {
+            if (!(fields >> config.smt >> config.hugePages))
+            {
+                config.smt       = "none";
+                config.hugePages = false;
+            }
+            configs.push_back(config);
+        }
+    }
+    return configs;
+}
+
+bool saveProfile(const string &path, const tuned_config &tuned)
+{
+    auto configs = loadProfile(path);
+    configs.erase(remove_if(configs.begin(), configs.end(), [&](const tuned_config &c) { return c.limit == tuned.limit; }),
+                  configs.end());
+    configs.push_back(tuned);
+
+    ofstream file(path, ios::trunc);
+    for (auto &config : configs)
+        file << config.limit << " " << engineName(config.engine) << " " << config.segmentBytes << " "
+             << config.threads << " " << config.rate << " " << config.smt << " " << config.hugePages << "\n";
+    return (bool) file;
+}
+
+// runAutotune
+//
+// Splits the time budget across every combination of engine, segment size, thread placement and (for bit and
+// byte storage) huge pages worth trying for this limit, measures the passes per second of each, and saves the
+// winner to the host's profile.  Placements are one unpinned thread, one pinned thread per physical core, one
+// pinned per logical CPU, and one unpinned per logical CPU as the OS sees fit.
+
+int runAutotune(uint64_t llUpperLimit, double budgetSeconds, const cache_topology &caches, const sieve_geometry &geometry, const string &szProfile)
+{
+    auto topology = detectCpuTopology();
+    vector<tuned_config> candidates;
+    vector<pair<unsigned int, string>> placements = { { 1, "none" }, { (unsigned int) topology.cores.size(), "off" } };
+    if (topology.logicalCount() > topology.cores.size())
+        placements.push_back({ (unsigned int) topology.logicalCount(), "on" });
+    if (find(placements.begin(), placements.end(), make_pair(max(1u, thread::hardware_concurrency()), string("none"))) == placements.end())
+        placements.push_back({ max(1u, thread::hardware_concurrency()), "none" });
+
+    vector<size_t> segmentSizes = { geometry.segmentBytes / 2, geometry.segmentBytes, geometry.segmentBytes * 2 };
+    if (caches.l2)
+        segmentSizes.push_back(caches.l2 / 2);
+
+    vector<bool> hugePageSettings = { false };
+    if (geometry.layout.storage != "bool")                      // vector<bool> can't be given huge pages
+        hugePageSettings.push_back(true);
+
+    for (auto &placement : placements)
+    {
+        for (bool hugePages : hugePageSettings)
+        {
+            tuned_config basic { llUpperLimit, sieve_engine::basic, geometry.segmentBytes, placement.first, 0 };
+            basic.smt       = placement.second;
+            basic.hugePages = hugePages;
+            candidates.push_back(basic);
+        }
+        for (size_t segmentBytes : segmentSizes)
+        {
+            tuned_config segmented { llUpperLimit, sieve_engine::segmented, segmentBytes, placement.first, 0 };
+            segmented.smt = placement.second;
+            candidates.push_back(segmented);
+        }
+    }
+
+    double trialSeconds = budgetSeconds / candidates.size();
+    tuned_config best;
+
+    printf("%-10s %14s %8s %5s %6s %14s\n", "Engine", "Segment", "Threads", "SMT", "Huge", "Passes/sec");
+    for (auto &candidate : candidates)
+    {
+        sieve_geometry trial = chooseGeometry(caches, candidate.segmentBytes, geometry.smallPrimeLimit, 0);
+        trial.layout    = geometry.layout;
+        trial.hugePages = candidate.hugePages;
+        vector<int> pinning;
+        if (candidate.smt != "none")
+            pinning = topology.placement(candidate.smt == "on");
+
+        auto tStart  = steady_clock::now();
+        auto cPasses = runPasses(candidate.engine, llUpperLimit, trial, candidate.threads, trialSeconds, nullptr, pinning);
+        candidate.rate = cPasses / (duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0);
+
+        printf("%-10s %14zu %8u %5s %6s %14.2lf\n", engineName(candidate.engine), candidate.segmentBytes, candidate.threads,
+               candidate.smt.c_str(), candidate.hugePages ? "yes" : "no", candidate.rate);
+        if (candidate.rate > best.rate)
+            best = candidate;
+    }
+
+    printf("Best: %s engine, %zu byte segments, %u thread%s (SMT %s), %s pages at %.2lf passes/sec.\n",
+           engineName(best.engine),
+           best.segmentBytes,
+           best.threads,
+           best.threads == 1 ? "" : "s",
+           best.smt.c_str(),
+           best.hugePages ? "huge" : "ordinary",
+           best.rate);
+
+    if (!saveProfile(szProfile, best))
+    {
+        fprintf(stderr, "Cannot write profile %s\n", szProfile.c_str());
+        return 1;
+    }
+    printf("Saved to %s\n", szProfile.c_str());
+    return 0;
+}
+
+// runNested
+//
+// Tries every way of splitting cThreads into N concurrent segmented sieves of M cooperating threads each, and
+// for each split reports the aggregate throughput along with the latency of an individual sieve, since the best
+// split for a mixed throughput/latency workload depends on the limit and on how much L3 the sieves share.
+
+int runNested(uint64_t llUpperLimit, unsigned int cThreads, double budgetSeconds, const sieve_geometry &geometry)
+{
+    segmented_sieve sieve(llUpperLimit, geometry);
+    atomic<bool> bValid { true };
+
+    vector<pair<unsigned int, unsigned int>> splits;
+    for (unsigned int n = 1; n <= cThreads; n++)
+        if (cThreads % n == 0)
+            splits.push_back({ n, cThreads / n });
+
+    printf("%8s %8s %10s %14s %12s %12s %12s\n", "Sieves", "Threads", "Passes", "Passes/sec", "Lat min", "Lat median", "Lat max");
+
+    for (auto split : splits)
+    {
+        unsigned int cSieves = split.first, cPerSieve = split.second;
+        vector<vector<double>> latencies(cSieves);
+        vector<thread> runners;
+        auto tStart = steady_clock::now();
+
+        for (unsigned int n = 0; n < cSieves; n++)
+        {
+            runners.push_back(thread([&, n]
+            {
+                do
+                {
+                    auto tPass = steady_clock::now();
+                    size_t count = sieve.countPrimes(cPerSieve);
+                    latencies[n].push_back(duration_cast<nanoseconds>(steady_clock::now() - tPass).count() / 1e9);
+                    if (hasExpectedCount(llUpperLimit) && !validateCount(llUpperLimit, count))
+                        bValid = false;
+                } while (duration_cast<microseconds>(steady_clock::now() - tStart).count() < budgetSeconds / splits.size() * 1000000);
+            }));
+        }
+        for (auto &th : runners)
+            th.join();
+
+        double elapsed = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+        vector<double> all;
+        for (auto &sieveLatencies : latencies)
+            all.insert(all.end(), sieveLatencies.begin(), sieveLatencies.end());
+        sort(all.begin(), all.end());
+
+        printf("%8u %8u %10zu %14.2lf %12.6lf %12.6lf %12.6lf\n",
+               cSieves,
+               cPerSieve,
+               all.size(),
+               all.size() / elapsed,
+               all.front(),
+               all[all.size() / 2],
+               all.back());
+    }
+
+    printf("Valid : %s\n", bValid.load() ? "Pass" : "FAIL!");
+    return bValid.load() ? 0 : 1;
+}
+
+// runLookups
+//
+// Answers cLookups isPrime queries spread at random over [0, limit) through the segment cache, then repeats a
+// quarter of them to show warm lookups, checking every answer with Miller-Rabin.
+
+int runLookups(uint64_t llUpperLimit, uint64_t cLookups, size_t cbCache, const sieve_geometry &geometry)
+{
+    prime_query_engine engine(cbCache, geometry);
+    vector<uint64_t> queries;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (uint64_t i = 0; i < cLookups; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        queries.push_back((state >> 1) % llUpperLimit);
+    }
+    for (uint64_t i = 0; i < cLookups / 4; i++)
+        queries.push_back(queries[i]);
+
+    auto tStart = steady_clock::now();
+    vector<bool> answers;
+    for (uint64_t n : queries)
+        answers.push_back(engine.isPrime(n));
+    auto tLookups = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    size_t cPrimes = 0, cWrong = 0;
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        cPrimes += answers[i];
+        cWrong  += (answers[i] != isPrimeMillerRabin(queries[i]));
+    }
+
+    printf("Lookups: %zu, Primes: %zu, Time: %lf, Per lookup: %.2lf us, Hits: %llu, Misses: %llu, Evictions: %llu, "
+           "Cached: %zu segments, Base primes: %zu, Valid : %s\n",
+           queries.size(),
+           cPrimes,
+           tLookups,
+           tLookups * 1e6 / max<size_t>(1, queries.size()),
+           (unsigned long long) engine.hits,
+           (unsigned long long) engine.misses,
+           (unsigned long long) engine.evictions,
+           engine.cachedSegments(),
+           engine.basePrimeCount(),
+           cWrong ? "FAIL!" : "Pass");
+    return cWrong ? 1 : 0;
+}
+
+// runQueryFile
+//
+// Reads "isprime n" / "pi x" lines from szQueries, answers them all in one sweep, and writes one answer per line
+// in the same order to szOutput (or stdout).
+
+int runQueryFile(const string &szQueries, const string &szOutput, unsigned int cThreads, const sieve_geometry &geometry)
+{
+    FILE *input = fopen(szQueries.c_str(), "r");
+    if (!input)
+    {
+        fprintf(stderr, "Cannot open %s\n", szQueries.c_str());
+        return 1;
+    }
+
+    vector<prime_query> queries;
+    char line[256], kind[32];
+    unsigned long long value;
+    size_t lineNumber = 0;
+    while (fgets(line, sizeof(line), input))
+    {
+        lineNumber++;
+        if (sscanf(line, "%31s %llu", kind, &value) != 2)
+            continue;                                           // Blank lines and the like
+        if (value >= UINT64_MAX)                                // The sweep runs to value + 1; bigger input saturates to this
+        {
+            fprintf(stderr, "%s:%zu: queries go up to %llu\n", szQueries.c_str(), lineNumber, (unsigned long long) (UINT64_MAX - 1));
+            fclose(input);
+            return 1;
+        }
+        if (!strcmp(kind, "isprime") || !strcmp(kind, "pi"))
+            queries.push_back({ (uint64_t) value, kind[0] == 'p' });
+        else
+            fprintf(stderr, "%s:%zu: unknown query %s\n", szQueries.c_str(), lineNumber, kind);
+    }
+    fclose(input);
+
+    auto tStart  = steady_clock::now();
+    auto answers = answerQueries(queries, cThreads, geometry);
+    auto tQuery  = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    FILE *output = szOutput.empty() ? stdout : fopen(szOutput.c_str(), "w");
+    if (!output)
+    {
+        fprintf(stderr, "Cannot open %s for writing\n", szOutput.c_str());
+        return 1;
+    }
+    for (uint64_t answer : answers)
+        fprintf(output, "%llu\n", (unsigned long long) answer);
+    if (output != stdout)
+        fclose(output);
+
+    fprintf(stderr, "Queries: %zu, Threads: %u, Time: %lf\n", queries.size(), cThreads, tQuery);
+    return 0;
+}
+
+// runNthPrime
+//
+// Finds the k-th prime with nthPrime and checks it against the known values at powers of ten.
+
+int runNthPrime(uint64_t k, const sieve_geometry &geometry)
+{
+    const std::map<const uint64_t, const uint64_t> nthPrimeDictionary =
+    {
+          {              1LLU, 2               },
+          {             10LLU, 29              },
+          {            100LLU, 541             },
+          {          1'000LLU, 7919            },
+          {         10'000LLU, 104729          },
+          {        100'000LLU, 1299709         },
+          {      1'000'000LLU, 15485863        },
+          {     10'000'000LLU, 179424673       },
+          {    100'000'000LLU, 2038074743      },
+          {  1'000'000'000LLU, 22801763489     },
+          { 10'000'000'000LLU, 252097800623    },
+    };
+
+    auto tStart = steady_clock::now();
+    uint64_t prime = nthPrime(k, geometry);
+    auto tNth = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    auto known  = nthPrimeDictionary.find(k);
+    auto bKnown = known != nthPrimeDictionary.end();
+    auto bValid = bKnown ? known->second == prime : isPrimeMillerRabin(prime);
+    printf("Prime #%llu: %llu, Time: %lf, Valid : %s\n",
+           (unsigned long long) k,
+           (unsigned long long) prime,
+           tNth,
+           bValid ? "Pass" : "FAIL!");
+    return bValid ? 0 : 1;
+}
+
+// runCountPrimes
+//
+// Answers pi(x), the number of primes <= x, from the loaded checkpoint table when it covers x and otherwise by
+// direct counting.
+
+int runCountPrimes(uint64_t x)
+{
+    auto tStart = steady_clock::now();
+    size_t count = 0;
+    auto bTable = x < UINT64_MAX && loadedCheckpoints.countBelow(x + 1, count);
+    if (!bTable)
+        count = (size_t) countPrimesUpTo(x);
+    auto tCount = duration_cast<microseconds>(steady_clock::now() - tStart).count() / 1000000.0;
+
+    printf("pi(%llu): %zu, Source: %s, Time: %lf\n",
+           (unsigned long long) x,
+           count,
+           bTable ? "checkpoints" : "counted",
+           tCount);
+    return 0;
+}
+
+// run_record
+//
+// The per-pass timings of one benchmark run, as saved with --results and compared against with --baseline.
+// Results files are JSON, {"runs": [...]} with one object per setup: the engine, limit, thread counts and
+// layout (storage/wheel/index) it ran with, plus a sample of its pass latencies in seconds.  Only runs of the
+// same setup replace or are compared with each other.
+
+struct run_record
+{
+    string         engine;
+    uint64_t       limit   = 0;
+    unsigned int   threads = 0;
+    unsigned int   sieveThreads = 1;                           // Absent from older files, which only ran 1
+    string         layout;
+    size_t         passes  = 0;
+    vector<double> samples;
+
+    bool sameSetup(const run_record &other) const
+    {
+        return engine == other.engine && limit == other.limit && threads == other.threads &&
+               sieveThreads == other.sieveThreads && layout == other.layout;
+    }
+
+    string setup() const
+    {
+        return engine + " engine, limit " + to_string(limit) + ", " + to_string(threads) + " thread" + (threads == 1 ? "" : "s") +
+               " x " + to_string(sieveThreads) + " sieve thread" + (sieveThreads == 1 ? "" : "s") + ", layout " + layout;
+    }
+};
+
+// json_reader
+//
+// Just enough of a JSON parser to read results files back: objects, arrays, strings without escapes beyond \"
+// and \\, and numbers, which are returned as their text so that 64-bit limits survive intact.
+
+class json_reader
+{
+  private:
+
+      const string &text;
+      size_t pos = 0;
+
+      void skipSpace()
       {
-          size_t count = (Bits.size() >= 2);                   // Count 2 as prime if within range
-          for (int i = 3; i < Bits.size(); i+=2)
-              if (Bits[i])
-                  count++;
-          return count;
+          while (pos < text.size() && isspace((unsigned char) text[pos]))
+              pos++;
       }
 
-      // isPrime 
-      // 
-      // Can be called after runSieve to determine whether a given number is prime. 
+  public:
 
-      bool isPrime(uint64_t n) const
+      json_reader(const string &json) : text(json)
       {
-          if (n & 1)
-              return Bits[n];
-          else
-              return false;
       }
 
-      // validateResults
-      //
-      // Checks to see if the number of primes found matches what we should expect.  This data isn't used in the
-      // sieve processing at all, only to sanity check that the results are right when done.
+      bool peek(char c)
+      {
+          skipSpace();
+          return pos < text.size() && text[pos] == c;
+      }
 
-      bool validateResults() const
+      bool expect(char c)
       {
-          const std::map<const uint64_t, const int> resultsDictionary =
-          {
-                {             10LLU, 4         },               // Historical data for validating our results - the number of primes
-                {            100LLU, 25        },               // to be found under some limit, such as 168 primes under 1000
-                {          1'000LLU, 168       },
-                {         10'000LLU, 1229      },
-                {        100'000LLU, 9592      },
-                {      1'000'000LLU, 78498     },
-                {     10'000'000LLU, 664579    },
-                {    100'000'000LLU, 5761455   },
-                {  1'000'000'000LLU, 50847534  },
-                { 10'000'000'000LLU, 455052511 },
-          };
-          if (resultsDictionary.end() == resultsDictionary.find(Bits.size()))
+          if (!peek(c))
               return false;
-          return resultsDictionary.find(Bits.size())->second == countPrimes();
+          pos++;
+          return true;
       }
 
-      // printResults
-      //
-      // Displays stats about what was found as well as (optionally) the primes themselves
+      bool readString(string &value)
+      {
+          if (!expect('"'))
+              return false;
+          value.clear();
+          while (pos < text.size() && text[pos] != '"')
+          {
+              if (text[pos] == '\\' && pos + 1 < text.size())
+                  pos++;
+              value += text[pos++];
+          }
+          return expect('"');
+      }
 
-      void printResults(bool showResults, double duration, size_t passes, size_t threads) const
+      bool readNumber(string &value)
       {
-          if (showResults)
-              cout << "2, ";
+          skipSpace();
+          size_t start = pos;
+          while (pos < text.size() && (isdigit((unsigned char) text[pos]) || strchr("+-.eE", text[pos])))
+              pos++;
+          value = text.substr(start, pos - start);
+          return pos > start;
+      }
 
-          size_t count = (Bits.size() >= 2);                   // Count 2 as prime if in range
-          for (uint64_t num = 3; num <= Bits.size(); num+=2)
+      bool skipValue()
+      {
+          string scratch;
+          if (peek('"'))
+              return readString(scratch);
+          if (expect('[') || expect('{'))
           {
-              if (Bits[num])
+              int depth = 1;
+              while (depth && pos < text.size())
               {
-                  if (showResults)
-                      cout << num << ", ";
-                  count++;
+                  if (peek('"'))
+                      readString(scratch);
+                  else
+                  {
+                      depth += (text[pos] == '[' || text[pos] == '{') - (text[pos] == ']' || text[pos] == '}');
+                      pos++;
+                  }
               }
+              return !depth;
           }
-
-          if (showResults)
-              cout << "\n";
-          
-          cout << "Passes: " << passes << ", "
-               << "Threads: " << threads << ", "
-               << "Time: " << duration << ", " 
-               << "Average: " << duration/passes << ", "
-               << "Limit: " << Bits.size() << ", "
-               << "Counts: " << count << "/" << countPrimes() << ", "
-               << "Valid : " << (validateResults() ? "Pass" : "FAIL!") 
-               << "\n";
+          if (readNumber(scratch))
+              return true;
+          for (const char *word : { "true", "false", "null" })
+              if (text.compare(pos, strlen(word), word) == 0)
+                  return (pos += strlen(word)), true;
+          return false;
       }
 };
 
+vector<run_record> loadResults(const string &path)
+{
+    vector<run_record> runs;
+    ifstream file(path);
+    string json((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    json_reader reader(json);
+    string key, value;
+
+    if (!reader.expect('{'))
+        return runs;
+    while (reader.readString(key) && reader.expect(':'))
+    {
+        if (key == "runs" && reader.expect('['))
+        {
+            while (reader.expect('{'))
+            {
+                run_record run;
+                while (reader.readString(key) && reader.expect(':'))
+                {
+                    if (key == "engine")
+                        reader.readString(run.engine);
+                    else if (key == "layout")
+                        reader.readString(run.layout);
+                    else if (key == "limit" && reader.readNumber(value))
+                        run.limit = strtoull(value.c_str(), nullptr, 10);
+                    else if (key == "threads" && reader.readNumber(value))
+                        run.threads = (unsigned int) strtoul(value.c_str(), nullptr, 10);
+                    else if (key == "sieveThreads" && reader.readNumber(value))
+                        run.sieveThreads = (unsigned int) strtoul(value.c_str(), nullptr, 10);
+                    else if (key == "passes" && reader.readNumber(value))
+                        run.passes = (size_t) strtoull(value.c_str(), nullptr, 10);
+                    else if (key == "samples" && reader.expect('['))
+                    {
+                        while (reader.readNumber(value))
+                        {
+                            run.samples.push_back(atof(value.c_str()));
+                            reader.expect(',');
+                        }
+                        reader.expect(']');
+                    }
+                    else
+                        reader.skipValue();
+                    reader.expect(',');
+                }
+                reader.expect('}');
+                reader.expect(',');
+                runs.push_back(run);
+            }
+            reader.expect(']');
+        }
+        else
+            reader.skipValue();
+        reader.expect(',');
+    }
+    return runs;
+}
+
+// saveResults
+//
+// Adds a run to a results file, replacing any earlier run of the same setup
+
+bool saveResults(const string &path, const run_record &record)
+{
+    auto runs = loadResults(path);
+    runs.erase(remove_if(runs.begin(), runs.end(), [&](const run_record &r) { return r.sameSetup(record); }), runs.end());
+    runs.push_back(record);
+
+    ofstream file(path, ios::trunc);
+    file << "{\"runs\": [\n";
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+        auto &run = runs[r];
+        file << "  {\"engine\": \"" << run.engine << "\", \"limit\": " << run.limit << ", \"threads\": " << run.threads
+             << ", \"sieveThreads\": " << run.sieveThreads << ", \"layout\": \"" << run.layout
+             << "\", \"passes\": " << run.passes << ", \"samples\": [";
+        char sample[32];
+        for (size_t i = 0; i < run.samples.size(); i++)
+        {
+            snprintf(sample, sizeof(sample), "%s%.9g", i ? ", " : "", run.samples[i]);
+            file << sample;
+        }
+        file << "]}" << (r + 1 < runs.size() ? "," : "") << "\n";
+    }
+    file << "]}\n";
+    return (bool) file;
+}
+
+// mannWhitney
+//
+// Two-sided Mann-Whitney U test of whether samples 'after' tend to be larger or smaller than 'before', using the
+// normal approximation with a correction for ties (plenty at the sample sizes a benchmark run produces).
+// Returns z, positive when 'after' tends larger, and sets pValue.
+
+double mannWhitney(const vector<double> &before, const vector<double> &after, double &pValue)
+{
+    size_t nBefore = before.size(), nAfter = after.size(), n = nBefore + nAfter;
+    pValue = 1;
+    if (!nBefore || !nAfter)
+        return 0;
+
+    vector<pair<double, bool>> pooled;                           // (value, came from 'after')
+    for (double v : before)
+        pooled.push_back({ v, false });
+    for (double v : after)
+        pooled.push_back({ v, true });
+    sort(pooled.begin(), pooled.end());
+
+    double rankSumAfter = 0, tieTerm = 0;
+    for (size_t i = 0; i < n; )
+    {
+        size_t j = i;
+        while (j < n && pooled[j].first == pooled[i].first)
+            j++;
+        double rank = (i + 1 + j) / 2.0;                         // Tied values share the mean of their ranks
+        for (size_t k = i; k < j; k++)
+            if (pooled[k].second)
+                rankSumAfter += rank;
+        double t = (double) (j - i);
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+
+    double u     = rankSumAfter - nAfter * (nAfter + 1) / 2.0;
+    double mean  = nBefore * (double) nAfter / 2;
+    double sigma = sqrt(nBefore * (double) nAfter / 12 * ((n + 1) - tieTerm / (n * (double) (n - 1))));
+    if (sigma <= 0)
+        return 0;
+
+    double z = (u - mean - (u > mean ? 0.5 : u < mean ? -0.5 : 0)) / sigma;
+    pValue = erfc(fabs(z) / sqrt(2.0));
+    return z;
+}
+
+double medianOf(vector<double> values)
+{
+    if (values.empty())
+        return 0;
+    nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+// compareBaseline
+//
+// Tests this run's pass latencies against the baseline run of the same setup and prints the speedup (baseline
+// median over current median) with the test's verdict.  Returns 0 if there's no significant regression at the
+// given significance level, 2 if there is, and 1 if there's no like-for-like run to compare against, in which
+// case the runs of the same engine and limit that are there get listed.
+
+int compareBaseline(const string &path, const run_record &current, double alpha)
+{
+    auto runs = loadResults(path);
+    auto baseline = find_if(runs.begin(), runs.end(), [&](const run_record &r) { return r.sameSetup(current); });
+    if (baseline == runs.end() || baseline->samples.empty() || current.samples.empty())
+    {
+        fprintf(stderr, "No run of %s to compare in %s\n", current.setup().c_str(), path.c_str());
+        for (auto &run : runs)
+            if (run.engine == current.engine && run.limit == current.limit)
+                fprintf(stderr, "  (there is one of %s)\n", run.setup().c_str());
+        return 1;
+    }
+
+    double pValue = 1;
+    double z      = mannWhitney(baseline->samples, current.samples, pValue);
+    double before = medianOf(baseline->samples), after = medianOf(current.samples);
+    bool bSignificant = pValue < alpha;
+    bool bRegression  = bSignificant && z > 0;
+
+    printf("Baseline %s engine, limit %llu: median pass %.6f s (n=%zu) -> %.6f s (n=%zu), speedup %.3fx, z=%.2f, p=%.3g: %s\n",
+           current.engine.c_str(),
+           (unsigned long long) current.limit,
+           before, baseline->samples.size(),
+           after, current.samples.size(),
+           after > 0 ? before / after : 0,
+           z, pValue,
+           !bSignificant ? "no significant change" : bRegression ? "REGRESSION" : "improvement");
+    return bRegression ? 2 : 0;
+}
+
 int main(int argc, char **argv)
 {
     vector<string> args(argv + 1, argv + argc);
@@ -158,37 +4414,81 @@ int main(int argc, char **argv)
     auto cSecondsRequested = 0;
     auto bPrintPrimes      = false;
     auto bOneshot          = false;
+    auto bBatch            = false;
+    auto bStream           = false;
+    auto bPipeline         = false;
+    auto bEliasFano        = false;
+    auto bMicrobench       = false;
+    size_t cbSegmentRequested = 0;
+    uint64_t ullSmallPrimesRequested  = 0;
+    uint64_t ullMediumPrimesRequested = 0;
+    auto engine            = sieve_engine::basic;
+    auto bEngineRequested  = false;
+    auto bAutotune         = false;
+    auto bNested           = false;
+    uint64_t cLookups      = 0;
+    string szQueries;
+    uint64_t ullNth        = 0;
+    uint64_t ullPi         = 0;
+    auto bPi               = false;
+    uint64_t ullStride     = 1 << 20;
+    string szWriteCheckpoints;
+    string szCheckpoints;
+    sieve_layout layout;
+    size_t cbSegmentCache  = 64 << 20;
+    auto bSegmentFromProfile = false;
+    string szOutput;
+    string szProfile       = defaultProfilePath();
+    double dStragglerPercent = 10;
+    auto bThreadStats      = false;
+    vector<thread_pass_stats> threadStats;
+    string szSmt;
+    string szResults;
+    string szBaseline;
+    double dAlpha          = 0.05;
+    string szCache         = "warm";
+    uint64_t ullMaxMemory  = 0;
+    uint64_t cJobs         = 0;
+    uint64_t ullResidue    = 0;
+    uint64_t ullModulus    = 0;
+    unsigned int cSieveThreads = 1;
+    unsigned int cInterleave   = 0;
+    auto bHugePages        = false;
+
+    // Answering a query file without -o makes the answers stdout's only content, so the banner and the rest of
+    // the run's chatter go to stderr instead
+
+    auto hasArg = [&args](const char *szArg) { return find(args.begin(), args.end(), szArg) != args.end(); };
+    FILE *info  = (hasArg("--queries") && !hasArg("-o") && !hasArg("--output")) ? stderr : stdout;
 
     // Process command-line args
 
-    cout << "Primes Benchmark (c) 2021 Dave's Garage - http://github.com/davepl/primes" << endl;
-    cout << "-------------------------------------------------------------------------" << endl;
+    fprintf(info, "Primes Benchmark (c) 2021 Dave's Garage - http://github.com/davepl/primes\n");
+    fprintf(info, "-------------------------------------------------------------------------\n");
 
     for (auto i = args.begin(); i != args.end(); ++i) 
     {
         if (*i == "-h" || *i == "--help") {
-              cout << "Syntax: " << argv[0] << " [-t,--threads threads] [-s,--seconds seconds] [-l,--limit limit] [-1,--oneshot] [-h] " << endl;
+              cout << "Syntax: " << argv[0] << " [-t,--threads threads] [-s,--seconds seconds] [-l,--limit limit] [-1,--oneshot] [-b,--batch] [--stream] [--pipeline [-o,--output file]] [--eliasfano] [--microbench] [--segment bytes] [--small-primes limit] [--medium-primes limit] [-e,--engine basic|segmented] [--autotune] [--profile file] [--nested] [--lookups count [--segment-cache MB]] [--queries file [-o,--output file]] [--nth k] [--write-checkpoints file [--stride n]] [--checkpoints file] [--pi x] [--storage bool|bit|byte] [--wheel 2|6|30|210] [--index 32|64] [--straggler percent] [--thread-stats] [--smt off|on|auto] [--results file] [--baseline file [--alpha p]] [--cache warm|cold] [--max-memory MB] [--jobs count] [--progression a,q] [--sieve-threads threads] [--interleave K] [--huge-pages] [-h] " << endl;
             return 0;
         }
         else if (*i == "-t" || *i == "--threads") 
         {
             i++;
-            cThreadsRequested = (i == args.end()) ? 0 : min(1, atoi(i->c_str()));
+            cThreadsRequested = (i == args.end()) ? 0 : max(1, atoi(i->c_str()));
         }
         else if (*i == "-s" || *i == "--seconds") 
         {
             i++;
-            cSecondsRequested = (i == args.end()) ? 0 : min(1, atoi(i->c_str()));
-            return 0;
+            cSecondsRequested = (i == args.end()) ? 0 : max(1, atoi(i->c_str()));
         }
         else if (*i == "-l" || *i == "--limit") 
         {
             i++;
-            ullLimitRequested = (i == args.end()) ? 0LL : min((long long)1, atoll(i->c_str()));
+            ullLimitRequested = (i == args.end()) ? 0LL : max((long long)1, atoll(i->c_str()));
         }
         else if (*i == "-1" || *i == "--oneshot") 
         {
-            i++;
             bOneshot = true;
             cThreadsRequested = 1;
         }
@@ -196,14 +4496,213 @@ int main(int argc, char **argv)
         {
              bPrintPrimes = true;
         }
+        else if (*i == "-b" || *i == "--batch") 
+        {
+             bBatch = true;
+        }
+        else if (*i == "--stream") 
+        {
+             bStream = true;
+        }
+        else if (*i == "--pipeline") 
+        {
+             bPipeline = true;
+        }
+        else if (*i == "--eliasfano") 
+        {
+             bEliasFano = true;
+        }
+        else if (*i == "--microbench") 
+        {
+             bMicrobench = true;
+        }
+        else if (*i == "--segment") 
+        {
+            i++;
+            cbSegmentRequested = (i == args.end()) ? 0 : (size_t) max(8LL, atoll(i->c_str()));
+        }
+        else if (*i == "--small-primes") 
+        {
+            i++;
+            ullSmallPrimesRequested = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str()));
+        }
+        else if (*i == "--medium-primes") 
+        {
+            i++;
+            ullMediumPrimesRequested = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str()));
+        }
+        else if (*i == "-e" || *i == "--engine") 
+        {
+            i++;
+            if (i == args.end() || !parseEngine(*i, engine))
+            {
+                fprintf(stderr, "Engine must be basic or segmented\n");
+                return 1;
+            }
+            bEngineRequested = true;
+        }
+        else if (*i == "--autotune") 
+        {
+             bAutotune = true;
+        }
+        else if (*i == "--nested") 
+        {
+             bNested = true;
+        }
+        else if (*i == "--lookups") 
+        {
+            i++;
+            cLookups = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str()));
+        }
+        else if (*i == "--segment-cache") 
+        {
+            i++;
+            cbSegmentCache = (i == args.end()) ? cbSegmentCache : (size_t) max(1LL, atoll(i->c_str())) << 20;
+        }
+        else if (*i == "--queries") 
+        {
+            i++;
+            szQueries = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--nth") 
+        {
+            i++;
+            ullNth = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str()));
+        }
+        else if (*i == "--write-checkpoints") 
+        {
+            i++;
+            szWriteCheckpoints = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--stride") 
+        {
+            i++;
+            ullStride = (i == args.end()) ? ullStride : (uint64_t) max(2LL, atoll(i->c_str()));
+        }
+        else if (*i == "--checkpoints") 
+        {
+            i++;
+            szCheckpoints = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--pi") 
+        {
+            i++;
+            bPi  = (i != args.end());
+            ullPi = bPi ? strtoull(i->c_str(), nullptr, 10) : 0;
+        }
+        else if (*i == "--storage") 
+        {
+            i++;
+            layout.storage = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--wheel") 
+        {
+            i++;
+            layout.wheel = (i == args.end()) ? 0 : (unsigned) atoi(i->c_str());
+        }
+        else if (*i == "--index") 
+        {
+            i++;
+            layout.indexBits = (i == args.end()) ? 0 : (unsigned) atoi(i->c_str());
+        }
+        else if (*i == "--straggler") 
+        {
+            i++;
+            dStragglerPercent = (i == args.end()) ? dStragglerPercent : max(0.0, atof(i->c_str()));
+        }
+        else if (*i == "--smt") 
+        {
+            i++;
+            szSmt = (i == args.end()) ? "" : *i;
+            if (szSmt != "off" && szSmt != "on" && szSmt != "auto")
+            {
+                fprintf(stderr, "SMT policy must be off, on or auto\n");
+                return 1;
+            }
+        }
+        else if (*i == "--huge-pages") 
+        {
+             bHugePages = true;
+        }
+        else if (*i == "--interleave") 
+        {
+            i++;
+            cInterleave = (i == args.end()) ? 0 : (unsigned int) max(1, atoi(i->c_str()));
+        }
+        else if (*i == "--sieve-threads") 
+        {
+            i++;
+            cSieveThreads = (i == args.end()) ? 1 : (unsigned int) max(1, atoi(i->c_str()));
+        }
+        else if (*i == "--progression") 
+        {
+            i++;
+            unsigned long long a = 0, q = 0;
+            if (i == args.end() || sscanf(i->c_str(), "%llu,%llu", &a, &q) != 2 || q == 0)
+            {
+                fprintf(stderr, "Progression must be given as a,q with q > 0\n");
+                return 1;
+            }
+            ullResidue = a;
+            ullModulus = q;
+        }
+        else if (*i == "--jobs") 
+        {
+            i++;
+            cJobs = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str()));
+        }
+        else if (*i == "--max-memory") 
+        {
+            i++;
+            ullMaxMemory = (i == args.end()) ? 0 : (uint64_t) max(1LL, atoll(i->c_str())) << 20;
+        }
+        else if (*i == "--cache") 
+        {
+            i++;
+            szCache = (i == args.end()) ? "" : *i;
+            if (szCache != "warm" && szCache != "cold")
+            {
+                fprintf(stderr, "Cache mode must be warm or cold\n");
+                return 1;
+            }
+        }
+        else if (*i == "--results") 
+        {
+            i++;
+            szResults = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--baseline") 
+        {
+            i++;
+            szBaseline = (i == args.end()) ? "" : *i;
+        }
+        else if (*i == "--alpha") 
+        {
+            i++;
+            dAlpha = (i == args.end()) ? dAlpha : min(1.0, max(0.0, atof(i->c_str())));
+        }
+        else if (*i == "--thread-stats") 
+        {
+             bThreadStats = true;
+        }
+        else if (*i == "--profile") 
+        {
+            i++;
+            szProfile = (i == args.end()) ? szProfile : *i;
+        }
+        else if (*i == "-o" || *i == "--output") 
+        {
+            i++;
+            szOutput = (i == args.end()) ? "" : *i;
+        }
         else 
         {
-            fprintf(stderr, "Unknown argument: %s", i->c_str());
+            fprintf(stderr, "Unknown argument: %s\n", i->c_str());
         }
     }
 
     if (bOneshot)
-        cout << "Oneshot is on" << endl;
+        fprintf(info, "Oneshot is on\n");
 
     if (bOneshot && (cSecondsRequested > 0 || cThreadsRequested > 1))   
     {
@@ -211,55 +4710,265 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    auto cPasses      = 0;
+    size_t cPasses    = 0;
     auto cSeconds     = (cSecondsRequested ? cSecondsRequested : 5);
     auto cThreads     = (cThreadsRequested ? cThreadsRequested : thread::hardware_concurrency());
     auto llUpperLimit = (ullLimitRequested ? ullLimitRequested : DEFAULT_UPPER_LIMIT);
 
-    printf("Computing primes to %llu on %d thread%s for %d second%s.\n", 
-           llUpperLimit,
+    // A previous --autotune run on this host may have found better settings for this limit; anything given
+    // explicitly on the command line still wins
+
+    if (!bAutotune)
+    {
+        for (auto &tuned : loadProfile(szProfile))
+        {
+            if (tuned.limit != llUpperLimit)
+                continue;
+            if (!bEngineRequested)
+                engine = tuned.engine;
+            if (!cbSegmentRequested)
+            {
+                cbSegmentRequested  = tuned.segmentBytes;
+                bSegmentFromProfile = true;
+            }
+            if (!cThreadsRequested)
+                cThreads = tuned.threads;
+            if (szSmt.empty() && tuned.smt != "none")
+                szSmt = tuned.smt;
+            bHugePages = bHugePages || tuned.hugePages;
+            fprintf(info, "Using tuned profile %s: %s engine, %zu byte segments, %u threads (SMT %s), %s pages.\n",
+                   szProfile.c_str(), engineName(tuned.engine), tuned.segmentBytes, tuned.threads,
+                   tuned.smt.c_str(), tuned.hugePages ? "huge" : "ordinary");
+        }
+    }
+
+    // With an SMT policy, workers are pinned one per physical core or one per logical CPU, and unless a thread
+    // count was given there's one worker per place; auto settles which after the geometry is known
+
+    auto topology = detectCpuTopology();
+    vector<int> pinning;
+    if (!szSmt.empty())
+    {
+        pinning = topology.placement(szSmt == "on");
+        if (!cThreadsRequested)
+            cThreads = (unsigned int) pinning.size();
+        fprintf(info, "SMT policy %s: %zu cores, %zu logical CPUs.\n", szSmt.c_str(), topology.cores.size(), topology.logicalCount());
+        if (szSmt != "auto" && cThreads > pinning.size())
+            fprintf(stderr, "SMT %s has %zu place%s for %u threads; the other %zu run unpinned\n",
+                    szSmt.c_str(), pinning.size(), pinning.size() == 1 ? "" : "s", cThreads, cThreads - pinning.size());
+    }
+
+    fprintf(info, "Computing primes to %llu on %d thread%s for %d second%s with the %s engine.\n", 
+           (unsigned long long) llUpperLimit,
            cThreads,
            cThreads == 1 ? "" : "s",
            cSeconds,
-           cSeconds == 1 ? "" : "s"
+           cSeconds == 1 ? "" : "s",
+           engineName(engine)
     );
 
-    auto tStart       = steady_clock::now();
+    // Size the segmented engines to this machine's caches, and say so, so runs on different hosts can be compared
 
-    if (!bOneshot)
+    auto caches   = detectCacheTopology();
+    auto geometry = chooseGeometry(caches, cbSegmentRequested, ullSmallPrimesRequested, ullMediumPrimesRequested);
+    if (bSegmentFromProfile)
+        geometry.source = "profile";
+    geometry.layout = layout;
+    geometry.sieveThreads = cSieveThreads;
+    geometry.interleave   = max(1u, cInterleave);
+    geometry.hugePages    = bHugePages;
+
+    // Under a memory budget, the engine and thread count are whatever keeps every pass in flight within it; an
+    // interleaved pass holds K basic sieves at once, and only the basic engine interleaves, so it stays put
+
+    if (ullMaxMemory)
+    {
+        if (!planMemory(ullMaxMemory, llUpperLimit, geometry, bEngineRequested || cInterleave, engine, cThreads))
+        {
+            fprintf(stderr, "Not even one %s pass to %llu fits in %llu MB\n", engineName(engine),
+                    (unsigned long long) llUpperLimit, (unsigned long long) (ullMaxMemory >> 20));
+            return 1;
+        }
+        fprintf(info, "Memory budget %llu MB: %s engine on %u thread%s, about %llu MB per pass.\n",
+               (unsigned long long) (ullMaxMemory >> 20),
+               engineName(engine),
+               cThreads,
+               cThreads == 1 ? "" : "s",
+               (unsigned long long) (passMemoryBytes(engine, llUpperLimit, geometry) >> 20));
+    }
+
+    uint64_t ullMaxLimit = 0;
+    if (!withLayout(layout, [&](auto *tag) { ullMaxLimit = remove_pointer_t<decltype(tag)>::maxLimit(); }))
+    {
+        fprintf(stderr, "Storage must be bool, bit or byte, wheel 2, 6, 30 or 210, and index 32 or 64\n");
+        return 1;
+    }
+    if (engine == sieve_engine::basic && llUpperLimit > ullMaxLimit)
+    {
+        fprintf(stderr, "A %u-bit index only reaches %llu with a wheel of %u\n", layout.indexBits, (unsigned long long) ullMaxLimit, layout.wheel);
+        return 1;
+    }
+
+    fprintf(info, "Caches: L1d %zuK, L2 %zuK, L3 %zuK. Segment: %zu bytes (%s), Small primes: < %llu, Medium primes: < %llu%s.\n",
+           caches.l1d >> 10,
+           caches.l2 >> 10,
+           caches.l3 >> 10,
+           geometry.segmentBytes,
+           geometry.source.c_str(),
+           (unsigned long long) geometry.smallPrimeLimit,
+           (unsigned long long) geometry.mediumPrimeLimit,
+           geometry.prefetchMedium ? " (prefetched)" : "");
+
+    // A checkpoint table extends validation to any limit it covers, so load it before anything runs
+
+    if (!szCheckpoints.empty())
     {
-        while (duration_cast<seconds>(steady_clock::now() - tStart).count() < cSeconds)
+        if (!loadedCheckpoints.load(szCheckpoints, geometry))
         {
-            vector<thread> threadPool;
-            
-            // We create N threads and give them each the job of runing the 'runSieve' method on a sieve
-            // that we create on the heap, rather than the stack, due to their possible enormity.  By using
-            // a unique_ptr it will automatically free resources as soon as its torn down.
+            fprintf(stderr, "Cannot load checkpoints from %s\n", szCheckpoints.c_str());
+            return 1;
+        }
+        fprintf(info, "Loaded pi(x) checkpoints up to %llu from %s.\n", (unsigned long long) loadedCheckpoints.coveredLimit(), szCheckpoints.c_str());
+    }
+
+    if (bAutotune)
+        return runAutotune(llUpperLimit, cSeconds, caches, geometry, szProfile);
+
+    auto tStart       = steady_clock::now();
+
+    if (bBatch)
+        return runBatch(llUpperLimit, geometry);
 
-            for (unsigned int i = 0; i < cThreads; i++)
-                threadPool.push_back(thread([llUpperLimit] { make_unique<prime_sieve>(llUpperLimit)->runSieve(); }));
+    if (bStream)
+        return runStream(llUpperLimit, bPrintPrimes, geometry);
 
-            // Now we wait for all of the threads to finish before we repeat
+    if (bPipeline)
+        return runPipeline(llUpperLimit, cThreads, szOutput, geometry);
 
-            for (auto &th : threadPool) 
-                th.join();
+    if (bEliasFano)
+        return runEliasFano(llUpperLimit, geometry);
 
-            // Credit us with one pass for each of the threads we did work on
-            cPasses += cThreads;
+    if (!szWriteCheckpoints.empty())
+    {
+        auto bWritten = pi_checkpoints::write(szWriteCheckpoints, llUpperLimit, ullStride, geometry);
+        printf("%s checkpoints to %llu every %llu to %s.\n",
+               bWritten ? "Wrote" : "FAILED writing",
+               (unsigned long long) llUpperLimit,
+               (unsigned long long) ullStride,
+               szWriteCheckpoints.c_str());
+        return bWritten ? 0 : 1;
+    }
+
+    if (bPi)
+        return runCountPrimes(ullPi);
+
+    if (ullNth)
+        return runNthPrime(ullNth, geometry);
+
+    if (!szQueries.empty())
+        return runQueryFile(szQueries, szOutput, cThreads, geometry);
+
+    if (cLookups)
+        return runLookups(llUpperLimit, cLookups, cbSegmentCache, geometry);
+
+    if (bNested)
+        return runNested(llUpperLimit, cThreads, cSeconds, geometry);
+
+    if (cInterleave)
+    {
+        if (engine != sieve_engine::basic)
+        {
+            fprintf(stderr, "Interleaving applies to the basic engine only\n");
+            return 1;
         }
+        return runInterleave(llUpperLimit, cInterleave, cThreads, cSeconds, geometry, ullMaxMemory);
+    }
+
+    if (ullModulus)
+        return runProgression(llUpperLimit, ullResidue, ullModulus, bPrintPrimes, geometry);
+
+    if (cJobs)
+        return runJobs(llUpperLimit, cJobs, cThreads, geometry);
+
+    if (szCache == "cold")
+        return runCacheModes(engine, llUpperLimit, cSeconds, caches, geometry);
+
+    if (bMicrobench)
+        return runMicrobench(llUpperLimit, cSecondsRequested ? cSecondsRequested : 0.1, geometry);
+
+    if (szSmt == "auto" && !bOneshot)
+    {
+        cThreads = runSmtTrial(engine, llUpperLimit, geometry, topology, cThreadsRequested, cSeconds, pinning);
+        tStart = steady_clock::now();
     }
+
+    if (!bOneshot)
+        cPasses = runPasses(engine, llUpperLimit, geometry, cThreads, cSeconds, &threadStats, pinning);
     else
     {
-        cPasses++;
+        cPasses += runEnginePass(engine, llUpperLimit, geometry);
     }
 
     auto tEnd = steady_clock::now() - tStart;
 
-    prime_sieve checkSieve(llUpperLimit);
-    checkSieve.runSieve();
-    checkSieve.printResults(bPrintPrimes, duration_cast<microseconds>(tEnd).count() / (double) llUpperLimit, cPasses, cThreads);
+    // Check the results with the same sieve layout that ran the passes
+
+    size_t cPrimes = 0;
+    if (ullMaxMemory && engine == sieve_engine::segmented)
+    {
+        // The budget may not hold a whole-range sieve, so check the count with a segmented sweep instead
+
+        size_t count = segmented_sieve(llUpperLimit, geometry).countPrimes();
+        double duration = duration_cast<microseconds>(tEnd).count() / (double) llUpperLimit;
+        cout << "Passes: " << cPasses << ", "
+             << "Threads: " << cThreads << ", "
+             << "Time: " << duration << ", "
+             << "Average: " << duration/cPasses << ", "
+             << "Limit: " << llUpperLimit << ", "
+             << "Counts: " << count << ", "
+             << "Valid : " << (validateCount(llUpperLimit, count) ? "Pass" : "FAIL!")
+             << "\n";
+        cPrimes = validateCount(llUpperLimit, count) ? count : 0;
+    }
+    else
+    {
+        withLayout(geometry.layout, [&](auto *tag)
+        {
+            auto checkSieve = make_unique<remove_pointer_t<decltype(tag)>>(llUpperLimit, geometry.sieveThreads, geometry.hugePages);
+            checkSieve->runSieve(geometry.sieveThreads);
+            checkSieve->printResults(bPrintPrimes, duration_cast<microseconds>(tEnd).count() / (double) llUpperLimit, cPasses, cThreads);
+            cPrimes = checkSieve->validateResults() ? checkSieve->countPrimes() : 0;
+        });
+    }
+    if (ullMaxMemory)
+        printf("Peak RSS: %llu MB of a %llu MB budget.\n",
+               (unsigned long long) (peakRssBytes() >> 20),
+               (unsigned long long) (ullMaxMemory >> 20));
+    reportThreadSpread(threadStats, dStragglerPercent, bThreadStats);
+    PHASE_REPORT();
+
+    // Keep this run's pass timings for later comparisons, and gate on the baseline if there is one; then the exit
+    // code is 0 for no significant regression, 2 for a regression, and 1 if the run failed or can't be compared
+
+    if (!szResults.empty() || !szBaseline.empty())
+    {
+        run_record record;
+        record.engine  = engineName(engine);
+        record.limit   = llUpperLimit;
+        record.threads = cThreads;
+        record.sieveThreads = cSieveThreads;
+        record.layout  = layout.storage + "/" + to_string(layout.wheel) + "/" + to_string(layout.indexBits);
+        record.passes  = cPasses;
+        for (auto &worker : threadStats)
+            record.samples.insert(record.samples.end(), worker.samples.begin(), worker.samples.end());
+
+        if (!szResults.empty() && !saveResults(szResults, record))
+            fprintf(stderr, "Cannot write results to %s\n", szResults.c_str());
+        if (!szBaseline.empty())
+            return (cPrimes || !hasExpectedCount(llUpperLimit)) ? compareBaseline(szBaseline, record, dAlpha) : 1;
+    }
 
     // On success return the count of primes found; on failure, return 0
 
-    return checkSieve.validateResults() ? checkSieve.countPrimes() : 0;
+    return (int) cPrimes;
 }
@@ -2,5 +2,6 @@
 # gcc -Ofast -std=c++17 PrimeCPP.cpp -lc++ -oPrimes_gcc.exe
 # clang -Ofast -std=c++17 -lc++ PrimeCPP.cpp -oPrimes_clang.exe
 
+# Add -DPRIME_INSTRUMENT for a per-phase timing breakdown at the end of the run
 clang++ -pthread -Ofast -std=c++17 PrimeCPP_PAR.cpp -oprimes_par.exe
 ./primes_par.exe